@@ -0,0 +1,241 @@
+#!/usr/bin/env ruby
+
+# bench.rb - Benchmarks of the Hashpipe extension and gateway hot paths.
+#
+# Creates (or reuses) a scratch status buffer, fills it with a realistic
+# number of keys, and measures the per-call cost of the hget/hput methods
+# (per key and batched), to_hash and snapshots (of one status buffer and of a
+# StatusSet), lock/unlock round trips, the gateway's Redis updates (against a
+# Redis server, if one is reachable), and the Prometheus exporter's
+# rendering.  Run via "rake bench" (which uses the extension built in ext) or
+# directly with the extension in the load path.
+#
+# Environment variables:
+#
+#   HASHPIPE_BENCH_INSTANCE - Instance id of the scratch status buffer [63]
+#   HASHPIPE_BENCH_KEYS     - Number of keys to fill it with [200]
+#   HASHPIPE_BENCH_TIME     - Approximate seconds per benchmark [0.5]
+#   REDIS_HOST              - Redis server for the Redis updates [localhost]
+
+require 'hashpipe'
+require 'hashpipe/keys'
+require 'hashpipe/statusbin'
+require 'hashpipe/metrics_renderer'
+require 'hashpipe/redis_updater'
+require 'socket'
+
+INSTANCE = Integer(ENV['HASHPIPE_BENCH_INSTANCE'] || 63)
+NKEYS = Integer(ENV['HASHPIPE_BENCH_KEYS'] || 200)
+TARGET = Float(ENV['HASHPIPE_BENCH_TIME'] || 0.5)
+REDIS_HOST = ENV['REDIS_HOST'] || 'localhost'
+
+def monotonic_now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# Returns the seconds taken to call the given block +n+ times.
+def time_it(n)
+  t0 = monotonic_now
+  i = 0
+  while i < n
+    yield
+    i += 1
+  end
+  monotonic_now - t0
+end
+
+# Measures the given block and prints the time per call and, if +per+ is
+# greater than 1, per item (e.g. per key of a batch call).  The number of
+# calls is calibrated to take about TARGET seconds.
+def bench(label, per=1, &block)
+  n = 1
+  n *= 2 while (t = time_it(n, &block)) < TARGET / 10
+  n = [(n * TARGET / t).ceil, 1].max
+  t = time_it(n, &block)
+  ns = t * 1e9 / n
+  if per > 1
+    printf "  %-44s %12.0f ns/op %10.0f ns/item\n", label, ns, ns / per
+  else
+    printf "  %-44s %12.0f ns/op\n", label, ns
+  end
+end
+
+def section(title)
+  puts
+  puts title
+end
+
+# Set up the scratch status buffer.  Keys are typical (8 character, upper
+# case) names with a mix of integer, float, and string values.
+STATUS = Hashpipe::Status.new(INSTANCE, true)
+STATUS.clear!
+FIELDS = (0...NKEYS).map {|i| 'BNCH%04d' % i}
+STATUS.lock do |st|
+  FIELDS.each_with_index do |k, i|
+    case i % 3
+    when 0; st.hputi4(k, i)
+    when 1; st.hputr8(k, i * 1.5)
+    else    st.hputs(k, "value #{i}")
+    end
+  end
+end
+
+# Keys near the start, middle, and end of the buffer
+KEY_FIRST = FIELDS[0]
+KEY_MID = FIELDS[NKEYS / 2 / 3 * 3]
+KEY_LAST = FIELDS[(NKEYS - 1) / 3 * 3]
+KEY_OBJ = Hashpipe::Key.new(KEY_LAST)
+BATCH = FIELDS.each_slice([NKEYS / 10, 1].max).map(&:first).first(10)
+BATCH_KEYS = BATCH.map {|k| Hashpipe::Key.new(k)}
+PUT_HASH = Hash[BATCH.each_with_index.map {|k, i| [k, i]}]
+
+puts "Hashpipe benchmarks: instance #{INSTANCE}, #{NKEYS} keys, " \
+     "#{STATUS.length} byte status buffer, Ruby #{RUBY_VERSION}"
+
+section 'Locking'
+bench('lock + unlock')                {STATUS.lock; STATUS.unlock}
+bench('lock {}')                      {STATUS.lock {}}
+bench('lock(timeout: 1) {}')          {STATUS.lock(timeout: 1) {}}
+bench('try_lock + unlock')            {STATUS.try_lock && STATUS.unlock}
+STATUS.lock_stats_enabled = true
+bench('lock {} (with lock stats)')    {STATUS.lock {}}
+STATUS.lock_stats_enabled = false
+
+section 'hget (status buffer locked)'
+STATUS.lock do |st|
+  bench("hgeti4 first key")           {st.hgeti4(KEY_FIRST)}
+  bench("hgeti4 middle key")          {st.hgeti4(KEY_MID)}
+  bench("hgeti4 last key")            {st.hgeti4(KEY_LAST)}
+  bench("hgeti4 last key (Key)")      {st.hgeti4(KEY_OBJ)}
+  bench("hgetr8 last key")            {st.hgetr8(KEY_LAST)}
+  bench("hgets last key")             {st.hgets(KEY_LAST)}
+  bench("hgets missing key")          {st.hgets('NOSUCHKY')}
+  bench("#{BATCH.length} x hgets", BATCH.length) do
+    BATCH.each {|k| st.hgets(k)}
+  end
+  bench("hget_many #{BATCH.length} keys", BATCH.length) do
+    st.hget_many(BATCH)
+  end
+  bench("hget_many #{BATCH.length} keys (Keys, :r8)", BATCH.length) do
+    st.hget_many(BATCH_KEYS, :r8)
+  end
+  numeric_buf = String.new
+  bench("fetch_numeric #{BATCH.length} keys (Keys, reused buf)",
+        BATCH.length) do
+    st.fetch_numeric(BATCH_KEYS, numeric_buf)
+  end
+  st.key_index = true
+  bench("hgeti4 last key (key index)")  {st.hgeti4(KEY_OBJ)}
+  bench("hget_many #{BATCH.length} keys (key index)", BATCH.length) do
+    st.hget_many(BATCH_KEYS)
+  end
+  st.key_index = false
+end
+
+section 'hput'
+bench("#{BATCH.length} x hputi4 under one lock", BATCH.length) do
+  STATUS.lock {|st| BATCH.each {|k| st.hputi4(k, 1)}}
+end
+bench("#{BATCH.length} x hputr8 under one lock", BATCH.length) do
+  STATUS.lock {|st| BATCH.each {|k| st.hputr8(k, 1.5)}}
+end
+bench("#{BATCH.length} x hputs under one lock", BATCH.length) do
+  STATUS.lock {|st| BATCH.each {|k| st.hputs(k, 'value')}}
+end
+bench("hput_many #{BATCH.length} keys", BATCH.length) do
+  STATUS.hput_many(PUT_HASH)
+end
+
+section 'Whole buffer'
+bench('to_hash')          {STATUS.to_hash}
+bench('checksum')         {STATUS.checksum}
+bench('snapshot')         {STATUS.snapshot}
+SNAP = STATUS.snapshot
+PREV = SNAP.to_hash
+bench('Snapshot#to_hash') {SNAP.to_hash}
+bench('Snapshot#diff')    {SNAP.diff(PREV)}
+bench('StatusBin.encode') {Hashpipe::StatusBin.encode(SNAP)}
+BLOB = Hashpipe::StatusBin.encode(SNAP)
+bench('StatusBin.decode') {Hashpipe::StatusBin.decode(BLOB)}
+
+# A StatusSet of the scratch buffer 8 times over, snapshot by its thread pool
+# and sequentially.  All 8 snapshots lock the same buffer, so this measures
+# the overhead of a round of the pool rather than its speedup.
+SET = Hashpipe::StatusSet.new([STATUS] * 8)
+bench('StatusSet#snapshot (8 threads)', 8) {SET.snapshot}
+SET1 = Hashpipe::StatusSet.new([STATUS] * 8)
+SET1.max_threads = 1
+bench('StatusSet#snapshot (1 thread)', 8)  {SET1.snapshot}
+
+# Options of the gateway's RedisUpdater and MetricsRenderer
+OPTS = {
+  :delay          => 1.0,
+  :domain         => 'hashpipe_bench',
+  :gwname         => Socket.gethostname,
+  :expire         => true,
+  :skip_unchanged => false,
+  :incremental    => false,
+  :format         => :hash
+}
+
+section 'Gateway RedisUpdater#update (per instance)'
+begin
+  require 'redis'
+  redis = Redis.new(:host => REDIS_HOST)
+  redis.ping
+  updater = Hashpipe::RedisUpdater.new(OPTS)
+  [
+    ['hash',                {}],
+    ['hash, incremental',   {:incremental => true}],
+    ['hash, skip unchanged', {:skip_unchanged => true}],
+    ['bin',                 {:format => :bin}],
+    ['both',                {:format => :both}]
+  ].each do |label, opts|
+    saved = OPTS.dup
+    OPTS.merge!(opts)
+    updater.update(redis, [SNAP])
+    bench("update (#{label})") {updater.update(redis, [SNAP])}
+    OPTS.replace(saved)
+  end
+  bench("update (hash, notify)") {updater.update(redis, [SNAP], true)}
+  # Clean up the benchmark keys
+  redis.del(Hashpipe::RedisKeys.status_key(OPTS[:gwname], INSTANCE,
+                                           OPTS[:domain]))
+  redis.del(Hashpipe::RedisKeys.statusbin_key(OPTS[:gwname], INSTANCE,
+                                              OPTS[:domain]))
+rescue LoadError, StandardError => e
+  puts "  skipped (#{e.class}: #{e.message})"
+end
+
+section 'Prometheus exporter (per scrape)'
+EXPORTER_CONF = {
+  'name'   => 'hashpipe_status_buffer',
+  'help'   => 'Hashpipe status buffer field',
+  'fields' => FIELDS.each_with_index.map do |k, i|
+    i % 3 == 2 ? {'name' => k, 'string' => true} : {'name' => k}
+  end
+}
+STATUS.lock_stats_enabled = true
+renderer = Hashpipe::MetricsRenderer.new(EXPORTER_CONF, [STATUS], OPTS)
+bench('render (unchanged)')      {renderer.render}
+bench('render gzip (unchanged)') {renderer.render(true)}
+n = 0
+bench('render (changed)') do
+  STATUS.lock {|st| st.hputi4(KEY_FIRST, n += 1)}
+  renderer.render
+end
+bench('render gzip (changed)') do
+  STATUS.lock {|st| st.hputi4(KEY_FIRST, n += 1)}
+  renderer.render(true)
+end
+# Configurations without gauge fields render only the derived metrics and
+# statistics
+[
+  ['no fields', []],
+  ['counter fields only', [{'name' => KEY_FIRST, 'type' => 'counter'}]]
+].each do |label, fields|
+  r = Hashpipe::MetricsRenderer.new(EXPORTER_CONF.merge('fields' => fields),
+                                    [STATUS], OPTS)
+  bench("render gzip (#{label})") {r.render(true)}
+end
+STATUS.lock_stats_enabled = false
@@ -5,7 +5,20 @@
 # Reads /proc/interrupts two times, SECONDS seconds apart, then calculates
 # and displays various IRQs/second statistics.
 #
-# Usage: hashpipe_irqps.rb [-v] PATTERN [SECONDS]
+# With the -c option, /proc/interrupts is instead sampled every SECONDS seconds
+# (on a fixed-rate timer) until interrupted and the statistics are displayed
+# after each sample.  The rates are calculated over the last WINDOW sampling
+# intervals (see the -w option), so they are rolling averages.  Only the
+# interrupts matching PATTERN are parsed.  The positions of their lines and
+# count columns are found when /proc/interrupts is first read and reused for
+# later samples (until the layout of the file changes).
+#
+# With the -I option, the per-CPU rates and their sum are also stored in the
+# Hashpipe status buffer of the given instance after each sample as "IRQPS%03d"
+# (where %03d is the CPU number) and "IRQPSSUM" (as r8 values), so they can be
+# picked up by hashpipe_redis_gateway.rb.
+#
+# Usage: hashpipe_irqps.rb [OPTIONS] PATTERN [SECONDS]
 #
 # Examples:
 #
@@ -22,61 +35,251 @@
 #     IRQ 115 CPU  4    624.0 IRQ/s   IR-PCI-MSI-edge eth2-5
 #     IRQ 117 CPU  4      3.0 IRQ/s   IR-PCI-MSI-edge eth2-13
 #     IRQ 119 CPU  4    623.0 IRQ/s   IR-PCI-MSI-edge eth2-15
-#     
+#
 #     CPU  4   2499.0 IRQ/s   55.3 %
 #     CPU  5   2023.0 IRQ/s   44.7 %
+#
+#     $ ./irqps.rb -c -w 5 -I 0 eth2 0.5
 
-if ARGV[0] == '-v'
-  VERBOSE = true
-  ARGV.shift
-else
-  VERBOSE = false
+require 'optparse'
+
+OPTS = {
+  :continuous => false,
+  :instance   => nil,
+  :verbose    => false,
+  :window     => 1
+}
+
+OP = OptionParser.new do |op|
+  op.program_name = File.basename($0)
+
+  op.banner = "Usage: #{op.program_name} [OPTIONS] PATTERN [SECONDS]"
+  op.separator('')
+  op.separator('Measure IRQs per second of interrupts matching PATTERN')
+  op.separator('over SECONDS (default 1) seconds.')
+  op.separator('')
+  op.separator('Options:')
+  op.on('-c', '--[no-]continuous',
+        "Sample every SECONDS until interrupted [#{OPTS[:continuous]}]") do |o|
+    OPTS[:continuous] = o
+  end
+  op.on('-I', '--instance=N', Integer,
+        "Store rates in status buffer N [#{OPTS[:instance].inspect}]") do |o|
+    OPTS[:instance] = o
+  end
+  op.on('-v', '--[no-]verbose',
+        "Show per-IRQ statistics [#{OPTS[:verbose]}]") do |o|
+    OPTS[:verbose] = o
+  end
+  op.on('-w', '--window=N', Integer,
+        "Sampling intervals per rate (with -c) [#{OPTS[:window]}]") do |o|
+    OPTS[:window] = [o, 1].max
+  end
+  #op.separator('')
+  op.on_tail('-h','--help','Show this message') do
+    puts op.help
+    exit
+  end
 end
+OP.parse!
+#p OPTS; exit
 
+VERBOSE = OPTS[:verbose]
 PATTERN = ARGV[0]
-SECONDS = Integer(ARGV[1]||1) rescue 1
-
-def get_irq_stats(pattern=nil)
-  header, *irqlines = File.readlines('/proc/interrupts')
-  cpus = header.split
-
-  irqlines = irqlines.grep(Regexp.new(pattern||'.'))
-  irqdata = {}
-  irqlines.each do |line|
-    stats = line.chomp.split(nil, cpus.length+2)
-    irq = stats.shift.to_i
-    info = stats.pop
-    stats.map! {|s| s.to_i}
-    irqdata[irq] = [stats, info]
-  end
-  irqdata
-end
+SECONDS = Float(ARGV[1]||1) rescue 1.0
 
-tic=get_irq_stats(PATTERN)
-sleep SECONDS
-toc=get_irq_stats(PATTERN)
-
-cpu_stats={}
-ips_sum = 0
-tic.keys.sort.each do |irq|
-  n0 = tic[irq][0]
-  n1 = toc[irq][0]
-  n0.each_with_index do |n, cpu|
-    ips = (n1[cpu] - n).to_f / SECONDS
-    if ips > 0
-      # Accumulate per-cpu stats
-      cpu_stats[cpu] ||= 0
-      cpu_stats[cpu]  += ips
-      ips_sum += ips
-      if VERBOSE
-        printf "IRQ %3d CPU %2d %8.1f IRQ/s   %s\n",
-          irq, cpu, ips, tic[irq][1].squeeze(' ')
+# Width of each count column following a line's "IRQ:" label (" %10u").
+COLUMN_WIDTH = 11
+
+# Samples /proc/interrupts.  The first sample (and any sample after the layout
+# of /proc/interrupts changes) finds the lines matching the pattern and the
+# positions of their count columns.  Other samples just read the file into a
+# reused buffer and convert the counts at the cached positions, without any
+# splitting or regular expression matching.
+class IrqSampler
+  # Array of CPU numbers of the count columns (from the header line)
+  attr_reader :cpus
+
+  def initialize(pattern=nil)
+    @regexp = Regexp.new(pattern||'.')
+    @file = File.open('/proc/interrupts')
+    @buf = String.new
+    @lines = nil
+  end
+
+  # Returns the IRQ labels (e.g. "110" or "NMI") of the matching lines.
+  def irqs
+    @lines.map {|l| l[:irq]}
+  end
+
+  # Returns the info (e.g. "IR-PCI-MSI-edge eth2-0") of the line for +irq+.
+  def info(irq)
+    @lines.find {|l| l[:irq] == irq}[:info]
+  end
+
+  # Reads /proc/interrupts and returns an Array containing, for each matching
+  # line (in the same order as #irqs), an Array of counts per CPU.
+  def sample
+    @file.rewind
+    @file.read(nil, @buf)
+    find_layout unless layout_valid?
+    @lines.map do |l|
+      pos = l[:pos]
+      Array.new(l[:ncols]) do |i|
+        @buf.byteslice(pos + i*COLUMN_WIDTH, COLUMN_WIDTH).to_i
       end
     end
   end
+
+  private
+
+  # Returns true if the cached layout still matches @buf.  Count columns have
+  # fixed widths, so the layout only changes when lines are added or removed.
+  def layout_valid?
+    return false unless @lines && @buf.bytesize == @size
+    @lines.all? {|l| @buf.byteslice(l[:off], l[:label].bytesize) == l[:label]}
+  end
+
+  # Finds the CPU numbers, the matching lines, and their count columns in @buf.
+  def find_layout
+    @size = @buf.bytesize
+    @lines = []
+    off = @buf.index("\n") + 1
+    @cpus = @buf[0, off].split.map {|c| c.sub('CPU', '').to_i}
+    while off < @size
+      eol = @buf.index("\n", off) || @size
+      line = @buf.byteslice(off, eol - off)
+      colon = line.index(':')
+      if colon && @regexp =~ line
+        # Count columns are those (up to one per CPU) that hold only a number
+        ncols = 0
+        while ncols < @cpus.length
+          col = line.byteslice(colon + 1 + ncols*COLUMN_WIDTH, COLUMN_WIDTH)
+          break unless col && col.length == COLUMN_WIDTH && col =~ /\A *\d+\z/
+          ncols += 1
+        end
+        @lines << {
+          :irq   => line[0, colon].strip,
+          :label => line[0, colon+1],
+          :off   => off,
+          :pos   => off + colon + 1,
+          :ncols => ncols,
+          :info  => line[colon + 1 + ncols*COLUMN_WIDTH..-1].to_s.strip
+        }
+      end
+      off = eol + 1
+    end
+  end
+end # class IrqSampler
+
+# Displays the statistics for the counts +tic+ and +toc+ (as returned by
+# IrqSampler#sample) taken +dt+ seconds apart.  Returns a Hash mapping CPU
+# number to the total IRQs per second of that CPU.
+def show_stats(sampler, tic, toc, dt)
+  cpu_stats={}
+  ips_sum = 0
+  # Numeric IRQs in numeric order, then others (e.g. "NMI") by name
+  order = sampler.irqs.each_with_index.sort_by {|irq, i| [irq.to_i, irq]}
+  order.each do |irq, i|
+    n0 = tic[i]
+    n1 = toc[i]
+    n0.each_with_index do |n, col|
+      ips = (n1[col] - n).to_f / dt
+      if ips > 0
+        # Accumulate per-cpu stats
+        cpu = sampler.cpus[col]
+        cpu_stats[cpu] ||= 0
+        cpu_stats[cpu]  += ips
+        ips_sum += ips
+        if VERBOSE
+          printf "IRQ %3s CPU %2d %8.1f IRQ/s   %s\n",
+            irq, cpu, ips, sampler.info(irq).squeeze(' ')
+        end
+      end
+    end
+  end
+  puts if VERBOSE
+
+  cpu_stats.keys.sort.each do |cpu|
+    printf "CPU %2d %8.1f IRQ/s  %5.1f %%\n", cpu, cpu_stats[cpu], 100.0*cpu_stats[cpu]/ips_sum
+  end
+
+  cpu_stats
+end
+
+# Status buffer to store rates in
+if OPTS[:instance]
+  require 'hashpipe'
+  begin
+    STATUS = Hashpipe::Status.new(OPTS[:instance], false)
+  rescue
+    puts "Error connecting to status buffer for instance #{OPTS[:instance]}"
+    exit 1
+  end
+else
+  STATUS = nil
 end
-puts if VERBOSE
 
-cpu_stats.keys.sort.each do |cpu|
-  printf "CPU %2d %8.1f IRQ/s  %5.1f %%\n", cpu, cpu_stats[cpu], 100.0*cpu_stats[cpu]/ips_sum
+# CPUs whose rates have been stored in the status buffer.  Their rates are
+# stored (as 0.0) even when they get no IRQs, so the values do not go stale.
+STORED_CPUS = {}
+
+# Stores +cpu_stats+ (as returned by show_stats) in the status buffer.
+def store_stats(cpu_stats)
+  cpu_stats.each_key {|cpu| STORED_CPUS[cpu] = true}
+  h = {}
+  STORED_CPUS.keys.sort.each do |cpu|
+    h['IRQPS%03d' % cpu] = (cpu_stats[cpu] || 0).to_f
+  end
+  h['IRQPSSUM'] = cpu_stats.values.inject(0.0, :+)
+  STATUS.hput_many(h)
+end
+
+def monotonic_now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+sampler = IrqSampler.new(PATTERN)
+
+if !OPTS[:continuous]
+  tic=sampler.sample
+  t0 = monotonic_now
+  sleep SECONDS
+  toc=sampler.sample
+  cpu_stats = show_stats(sampler, tic, toc, monotonic_now - t0)
+  store_stats(cpu_stats) if STATUS
+  exit
+end
+
+# Rolling window of [time, counts] samples
+samples = [[monotonic_now, sampler.sample]]
+irqs = sampler.irqs
+next_time = samples[0][0] + SECONDS
+begin
+  loop do
+    # Fixed-rate (drift free) timer; skip missed ticks
+    delay = next_time - monotonic_now
+    sleep delay if delay > 0
+    next_time += SECONDS
+    next_time = monotonic_now + SECONDS if next_time < monotonic_now
+
+    counts = sampler.sample
+    now = monotonic_now
+    # Start over if the set of matching interrupts changed
+    if sampler.irqs != irqs
+      irqs = sampler.irqs
+      samples = [[now, counts]]
+      next
+    end
+    samples << [now, counts]
+    samples.shift while samples.length > OPTS[:window] + 1
+
+    t0, tic = samples.first
+    puts Time.now.strftime('%F %T')
+    cpu_stats = show_stats(sampler, tic, counts, now - t0)
+    puts
+    STDOUT.flush
+    store_stats(cpu_stats) if STATUS
+  end
+rescue Interrupt
 end
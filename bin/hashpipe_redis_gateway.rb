@@ -18,12 +18,27 @@
 #
 #   Example: hashpipe://px1/0/status
 #
+# With the --format=bin option, the contents of each status buffer are instead
+# stored as a single compressed binary blob (see Hashpipe::StatusBin) under
+# the "statusbin key".  This is much less work for the Redis server than a hash
+# with one field per status buffer key.  The --format=both option writes both
+# the status key and the statusbin key.
+#
+# Statusbin key format:
+#
+#   "hashpipe://#{gwname}/#{instance_id}/statusbin"
+#
+#   Example: hashpipe://px1/0/statusbin
+#
 # Update channel format:
 #
 #   "hashpipe://#{gwname}/#{instance_id}/update"
 #
 #   Example: hashpipe://px1/0/update
 #
+# The message published on the update channel is the status key (or the
+# statusbin key with --format=bin).
+#
 # Additionally, a thread is started that subscribes to "command channels" so
 # that key/value pairs can be published via Redis.  Recevied key/value pairs
 # are stored in the status buffers as appropriate for the channel on which they
@@ -46,6 +61,27 @@
 # Messages sent to "set" channels are expected to be in "key=value" format with
 # multiple key/value pairs separated by newlines ("\n").
 #
+# Status buffer "req" channels are used to request the values of fields from a
+# specific status buffer instance, and the broadcast "req" channel from all
+# instances:
+#
+#   "hashpipe://#{gwname}/#{instance_id}/req"
+#   "hashpipe:///req"
+#
+# Messages sent to "req" channels are either field names separated by newlines
+# ("\n") or JSON.  The reply is published on the instance's "rep" channel:
+#
+#   "hashpipe://#{gwname}/#{instance_id}/rep"
+#
+# The reply to a newline separated request is "key=value" pairs separated by
+# newlines.  A JSON request is an Array of field names, or an Object whose
+# "keys" member is either an Array of field names or an Object mapping field
+# names to type codes ("i4", "i8", "u4", "u8", "r4", "r8", or "s").  The reply
+# to a JSON request is a JSON Object mapping field names to values, converted
+# according to their type codes (default "s"), or null for missing fields.
+# For example, the request '{"keys": {"NETSTAT": "s", "PKTIDX": "i8"}}' could
+# get the reply '{"NETSTAT":"receiving","PKTIDX":123456}'.
+#
 # The gateway command channel is used to send commands to the gateway itself.
 # The format of the gateway command channel is:
 #
@@ -67,6 +103,40 @@
 #                   that SECONDS is interpreted as a floating point number
 #                   (e.g. "0.25").
 #
+# With the --skip-unchanged option, status buffers whose contents have not
+# changed since the previous update (as determined by Status#checksum) are not
+# rewritten to Redis and no update notification is published for them, but
+# the expiration time of their status key is still refreshed.
+#
+# With the --incremental option, the status key is only fully rewritten
+# (via DEL and HMSET) on the first update and every 60 seconds thereafter.
+# Other updates use Status#diff to HSET only the fields that have been added or
+# changed and HDEL only the fields that have been deleted since the previous
+# update.  No update notification is published when nothing has changed.
+#
+# Snapshotting the status buffers and writing them to Redis are done by
+# separate threads.  The snapshot thread snapshots all status buffers on a
+# fixed-rate (drift free) timer with period equal to the delay and hands the
+# snapshots to the Redis writer thread via a store that holds only the latest
+# not yet written snapshot of each instance.  A slow Redis server therefore
+# does not delay snapshots; instead, older snapshots are replaced by newer
+# ones.  Timer ticks missed because snapshotting took longer than the delay
+# are counted as "snapshot overruns" and snapshots replaced before being
+# written are counted as "writer overruns".  Both counts are exported by the
+# Prometheus exporter (see below).
+#
+# With the --connections=N option, N Redis writer threads (each with its own
+# Redis connection and snapshot store) write to Redis in parallel.  Each
+# instance's updates always go to the same writer, chosen by the Redis Cluster
+# hash slot of its status key (see Hashpipe::RedisKeys#key_shard), so updates
+# of any one instance stay in order.
+#
+# With the --wait-for-change option, the gateway does not sleep for the full
+# delay between updates.  Instead it waits (via StatusSet#wait_for_change) for
+# any status buffer to change and then updates Redis promptly, but no more
+# often than every 0.1 seconds.  The delay is still the longest time between
+# updates (so status keys do not expire).
+#
 # # PROMETHEUS EXPORTER
 #
 # The gateway can also start a Prometheus exporter to expose user-specified
@@ -101,15 +171,110 @@
 #     hashpipe_status_buffer{domain="bluse", hpinstance="blpn48/0", name="RA"} 156.3626
 #     hashpipe_status_buffer{domain="bluse", hpinstance="blpn48/0", name="DEC"} 46.6493
 #     hashpipe_status_buffer{domain="bluse", hpinstance="blpn48/0", name="SRC_NAME", value="3C295"} 1
+#
+# Numeric field specifiers may also have these options, which are computed by
+# the gateway from its successive snapshots of the status buffer (i.e. at the
+# gateway's sampling resolution rather than Prometheus's scrape interval):
+#
+#   type: counter    The field is a monotonically increasing counter (e.g.
+#                    NETPKTS).  It is exported in the "_total" counter metric
+#                    instead of the gauge metric.
+#   rate: true       The per second rate of change of the field (between
+#                    successive snapshots) is exported in the "_rate" gauge
+#                    metric.  A decrease is treated as a counter reset.
+#   histogram: [...] Each snapshot's value (or rate, if "rate" is true) of the
+#                    field is observed into the "_histogram" histogram metric
+#                    with the given bucket upper bounds.
+#
+# For example:
+#
+#     fields:
+#       - name: NETPKTS
+#         type: counter
+#         rate: true
+#         histogram: [1000, 10000, 100000]
+#
+# This will result in metrics like:
+#
+#     hashpipe_status_buffer_total{domain="bluse", hpinstance="blpn48/0", name="NETPKTS"} 1234567
+#     hashpipe_status_buffer_rate{domain="bluse", hpinstance="blpn48/0", name="NETPKTS"} 24414.1
+#     hashpipe_status_buffer_histogram_bucket{domain="bluse", hpinstance="blpn48/0", name="NETPKTS", le="1000"} 0
+#     ...
+#
+# The exporter also exposes statistics about the gateway's own use of the
+# status buffer locks: "_lock_acquisitions_total", "_lock_wait_seconds_total",
+# "_lock_wait_seconds_max", "_lock_hold_seconds_total", and
+# "_lock_hold_seconds_max" metrics (each suffixed to the metric name) with
+# "domain" and "hpinstance" labels.  The maximums are since gateway startup.
+# The "_snapshot_overruns_total" and "_writer_overruns_total" metrics (with
+# "domain" and "gateway" labels) expose the counts of the gateway's snapshot
+# and Redis writer threads falling behind.
 
 require 'rubygems'
 require 'optparse'
 require 'socket'
+require 'json'
 require 'redis'
 require 'hashpipe'
+require 'hashpipe/keys'
+require 'hashpipe/statusbin'
+require 'hashpipe/redis_updater'
 
 DEFAULT_EXPORTER_PORT = 9661
 
+# Maximum number of seconds to wait for a status buffer lock when handling
+# requests.
+LOCK_TIMEOUT = 1.0
+
+# Minimum number of seconds between updates with --wait-for-change.
+MIN_UPDATE_INTERVAL = 0.1
+
+# PIPELINE_STATS holds the count of the snapshot thread missing timer ticks.
+# Writer overruns are counted by each SnapshotStore.
+PIPELINE_STATS = {
+  :snapshot_overruns => 0
+}
+
+# A SnapshotStore holds the latest not yet written Snapshot of each instance.
+# The snapshot thread pushes snapshots into it and a Redis writer thread
+# takes them out.  Pushing a snapshot for an instance whose previous snapshot
+# has not yet been taken replaces it (and counts a writer overrun), so the
+# store never holds more than one snapshot per instance.
+class SnapshotStore
+  # Number of snapshots replaced before being taken
+  attr_reader :overruns
+
+  def initialize
+    @mutex = Mutex.new
+    @cond = ConditionVariable.new
+    @pending = {}
+    @overruns = 0
+  end
+
+  # Adds +snapshots+ (nil elements are ignored).
+  def push(snapshots)
+    @mutex.synchronize do
+      snapshots.each do |sb|
+        next unless sb
+        iid = sb.instance_id
+        @overruns += 1 if @pending.key?(iid)
+        @pending[iid] = sb
+      end
+      @cond.signal
+    end
+  end
+
+  # Waits for and removes all pending snapshots, returning them as an Array.
+  def take
+    @mutex.synchronize do
+      @cond.wait(@mutex) while @pending.empty?
+      snapshots = @pending.values
+      @pending = {}
+      snapshots
+    end
+  end
+end # class SnapshotStore
+
 OPTS = {
   :create       => false,
   :delay        => 1.0,
@@ -120,6 +285,11 @@ OPTS = {
   :notify       => false,
   :server       => 'redishost',
   :expire       => true,
+  :skip_unchanged => false,
+  :incremental  => false,
+  :wait         => false,
+  :connections  => 1,
+  :format       => :hash,
   :prometheus   => nil
 }
 
@@ -141,6 +311,10 @@ OP = OptionParser.new do |op|
     o = 60.0 if o > 60.0
     OPTS[:delay] = o
   end
+  op.on('-C', '--connections=N', Integer,
+        "Number of Redis writer connections [#{OPTS[:connections]}]") do |o|
+    OPTS[:connections] = o < 1 ? 1 : o
+  end
   op.on('-D', '--domain=DOMAIN',
         "Domain for Redis channels/keys [#{OPTS[:domain]}]") do |o|
     OPTS[:domain] = o
@@ -149,6 +323,10 @@ OP = OptionParser.new do |op|
         "Run in foreground [#{OPTS[:foreground]}]") do |o|
     OPTS[:foreground] = o
   end
+  op.on('-F', '--format=FORMAT', [:hash, :bin, :both],
+        "Status format to write (hash, bin, both) [#{OPTS[:format]}]") do |o|
+    OPTS[:format] = o
+  end
   op.on('-g', '--gwname=GWNAME',
         "Name of this gateway [#{OPTS[:gwname]}]") do |o|
     OPTS[:gwname] = o
@@ -158,6 +336,10 @@ OP = OptionParser.new do |op|
     OPTS[:instance_ids] = o.map {|s| Integer(s) rescue 0}
     OPTS[:instance_ids].uniq!
   end
+  op.on('-I', '--[no-]incremental',
+        "Only write changed fields to Redis [#{OPTS[:incremental]}]") do |o|
+    OPTS[:incremental] = o
+  end
   op.on('-n', '--[no-]notify',
         "Publish update notifications [#{OPTS[:notify]}]") do |o|
     OPTS[:notify] = o
@@ -171,6 +353,14 @@ OP = OptionParser.new do |op|
         "Host running redis-server [#{OPTS[:server]}]") do |o|
     OPTS[:server] = o
   end
+  op.on('-u', '--[no-]skip-unchanged',
+        "Skip unchanged status buffers [#{OPTS[:skip_unchanged]}]") do |o|
+    OPTS[:skip_unchanged] = o
+  end
+  op.on('-w', '--[no-]wait-for-change',
+        "Update promptly when status changes [#{OPTS[:wait]}]") do |o|
+    OPTS[:wait] = o
+  end
   op.on('-x', '--no-expire',
         "Disable expiration of redis keys") do |o|
     OPTS[:expire] = o
@@ -201,6 +391,10 @@ OPTS[:instance_ids].each do |i|
 end
 #p STATUS_BUFS; exit
 
+# STATUS_SET holds the attached Status objects for snapshotting them all at
+# once (without the GVL) for updating Redis.
+STATUS_SET = Hashpipe::StatusSet.new(instance_ids.map {|i| STATUS_BUFS[i]})
+
 # If we got nothing, exit
 if instance_ids.empty?
   puts "No status buffers to gateway"
@@ -225,6 +419,63 @@ BCASTREQ_CHANNEL = "#{OPTS[:domain]}:///req"
 GWCMD_CHANNEL = "#{OPTS[:domain]}://#{OPTS[:gwname]}/gateway"
 BCASTCMD_CHANNEL = "#{OPTS[:domain]}:///gateway"
 
+# Returns the requested keys of +msg+, a message received on a "req" channel,
+# and whether a JSON reply was requested.  See handle_request.
+def parse_request(msg)
+  return [msg.split("\n").map {|k| [k, :s]}, false] unless msg =~ /\A\s*[\[{]/
+
+  req = JSON.parse(msg)
+  req = req['keys'] if req.is_a?(Hash)
+  if req.is_a?(Hash)
+    # Values are type codes (e.g. "i8"), which hget_many wants as Symbols
+    req = req.map {|k, t| [k, t ? t.to_sym : :s]}
+  end
+  [Array(req).map {|k| Array === k ? k : [k, :s]}, true]
+end
+
+# Handles +msg+, a request received on a "req" channel for instances +insts+,
+# by publishing a reply containing the requested values from each instance's
+# status buffer on its "rep" channel.  All values of an instance are fetched
+# with one Status#hget_many under one lock and all replies are published in one
+# pipeline.  Instances whose lock cannot be acquired within LOCK_TIMEOUT
+# seconds are not replied to.
+def handle_request(publisher, insts, msg)
+  keys, json = parse_request(msg)
+
+  replies = []
+  insts.each do |inst|
+    sb = STATUS_BUFS[inst] or next
+    # Skip instances whose lock is held too long (e.g. by a wedged pipeline
+    # thread) rather than stalling the subscribe thread.
+    values = sb.lock(timeout: LOCK_TIMEOUT) {sb.hget_many(keys)}
+    next unless values
+
+    names = keys.map(&:first)
+    if OPTS[:foreground]
+      names.each_with_index do |k, j|
+        puts "#{OPTS[:gwname]}/#{inst} #{k}=#{values[j]} (#{values[j].class})"
+      end
+    end
+
+    payload = if json
+                # JSON has no NaN or Infinity, so send those as Strings
+                values = values.map do |v|
+                  v.is_a?(Float) && !v.finite? ? v.to_s : v
+                end
+                JSON.generate(Hash[names.zip(values)])
+              else
+                names.zip(values).map {|k, v| "#{k}=#{v}"}.join("\n")
+              end
+    replies << ["#{OPTS[:domain]}://#{OPTS[:gwname]}/#{inst}/rep", payload]
+  end
+
+  publisher.pipelined do |pipe|
+    replies.each {|chan, payload| pipe.publish(chan, payload)}
+  end
+rescue JSON::JSONError, ArgumentError, TypeError => e
+  puts "bad request #{msg.inspect}: #{e}" if OPTS[:foreground]
+end
+
 # Create subscribe thread
 subscribe_thread = Thread.new do
   # Create Redis objects for publishing/subscribing
@@ -243,25 +494,22 @@ subscribe_thread = Thread.new do
                 end
 
         pairs = msg.split("\n").map {|s| s.split('=')}
-        insts.each do |i|
-          sb = STATUS_BUFS[i]
-          pairs.each do |k,v|
-            # If v is all digits, convert to Integer
-            # otherwise try to convert to Float
-            if /^\d+$/ =~ v
-              v = v.to_i
-            else
-              v = Float(v) rescue v
-            end
-
-            sb.lock do
-              case v
-              when Integer; sb.hputi8(k, v)
-              when Float;   sb.hputr8(k, v)
-              else sb.hputs(k, v)
-              end
-            end
+        updates = {}
+        pairs.each do |k,v|
+          # If v is all digits, convert to Integer
+          # otherwise try to convert to Float
+          if /^\d+$/ =~ v
+            v = v.to_i
+          else
+            v = Float(v) rescue v
           end
+          updates[k] = v
+        end
+
+        # hput_many stores Integers as i8, Floats as r8, and all else as
+        # strings, all under a single lock.
+        insts.each do |i|
+          STATUS_BUFS[i].hput_many(updates)
         end
 
       when BCASTREQ_CHANNEL, *SBREQ_CHANNELS
@@ -270,21 +518,7 @@ subscribe_thread = Thread.new do
                 when %r{/(\w+)/req}; [$1]
                 end
 
-        keys = msg.split("\n")
-        insts.each do |inst|
-          sb = STATUS_BUFS[inst]
-          resp = []
-          sb.lock do
-            resp = keys.map do |k|
-              "#{k}=#{sb.hgets(k)}"
-
-              if OPTS[:foreground]
-                puts "#{OPTS[:gwname]}/#{i} #{k}=#{v} (#{v.class})"
-              end
-            end
-          end
-          publisher.publish("#{OPTS[:domain]}://#{OPTS[:gwname]}/#{inst}/rep", resp.join("\n"))
-        end
+        handle_request(publisher, insts, msg)
 
       # Gateway channels
       when BCASTCMD_CHANNEL, GWCMD_CHANNEL
@@ -299,8 +533,8 @@ subscribe_thread = Thread.new do
             delay = 0.25 if delay < 0.25
             delay = 60.0 if delay > 60.0
             OPTS[:delay] = delay
-            # Wake up main thread
-            Thread.main.wakeup
+            # Wake up snapshot thread
+            SNAPSHOT_THREAD.wakeup if defined?(SNAPSHOT_THREAD)
           end
         end
 
@@ -309,87 +543,195 @@ subscribe_thread = Thread.new do
   end # subcribe
 end # subscribe thread
 
-def export_metrics(req, res)
-  start = Time.now
-  body = StringIO.new
-
-  metric = OPTS[:prometheus]['name']
-
-  if OPTS[:prometheus]['fields']
-    help   = OPTS[:prometheus]['help']
-    body.puts "# HELP #{metric} #{help}"
-    body.puts "# TYPE #{metric} gauge"
-
-    OPTS[:instance_ids].each do |iid|
-      sb = STATUS_BUFS[iid].to_hash
-      OPTS[:prometheus]['fields'].each do |field|
-        name = field['name']
-        value = sb[name]
-        next unless value
-
-        body.print "#{metric}{domain=\"#{OPTS[:domain]}\", " +
-                   "hpinstance=\"#{OPTS[:gwname]}/#{iid}\", " +
-                   "name=\"#{name}\""
-
-        if field['string']
-          body.print ", value=\"#{value}\""
-          value = 1
-        else
-          value = value.to_r.to_f
-        end
 
-        body.puts "} #{value}"
+# A MetricsServer is a minimal HTTP/1.x server for the Prometheus exporter.
+# It serves all connections from a single thread using IO.select and
+# non-blocking reads and writes, so a slow or concurrent scrape never blocks
+# (or spawns) a thread and costs the rest of the gateway no more GVL time than
+# it takes to render the (mostly cached) response.  Each connection handles
+# one GET or HEAD request and is then closed.
+class MetricsServer
+  # Maximum size of a request (request line and headers)
+  MAX_REQUEST = 8192
+  # Seconds after which idle connections are closed
+  IDLE_TIMEOUT = 10
+
+  # Per-connection state
+  Client = Struct.new(:io, :in, :out, :since)
+
+  def initialize(bind, port, &handler)
+    @server = TCPServer.new(bind, port)
+    @handler = handler
+    @clients = {}
+    @running = false
+  end
+
+  # Serves requests until #shutdown is called.  The block given to ::new is
+  # called with the request path and a Hash of (lower case) header names and
+  # values and must return [status, content_type, body, extra_headers].
+  def start
+    @running = true
+    while @running
+      readers, writers = @clients.values.partition {|c| !c.out}
+      ready = IO.select([@server] + readers.map(&:io), writers.map(&:io),
+                        nil, 1.0)
+      if ready
+        ready[0].each {|io| io == @server ? accept : read(@clients[io])}
+        ready[1].each {|io| c = @clients[io] and write(c)}
+      end
+      expire_idle
+    end
+  ensure
+    @clients.each_key {|io| io.close rescue nil}
+    @clients.clear
+    @server.close rescue nil
+  end
+
+  # Stops the server (within about a second).
+  def shutdown
+    @running = false
+  end
+
+  private
+
+  def accept
+    io = @server.accept_nonblock(exception: false)
+    return if io == :wait_readable
+    @clients[io] = Client.new(io, ''.b, nil, Time.now)
+  end
+
+  def close(client)
+    @clients.delete(client.io)
+    client.io.close rescue nil
+  end
+
+  def read(client)
+    return unless client && !client.out
+    data = client.io.read_nonblock(MAX_REQUEST, exception: false)
+    return if data == :wait_readable
+    return close(client) if data.nil?
+
+    client.in << data
+    if (eoh = client.in.index("\r\n\r\n"))
+      respond(client, client.in[0, eoh])
+    elsif client.in.bytesize > MAX_REQUEST
+      reply(client, 431, 'text/plain', "Request too large\n")
+    end
+  rescue SystemCallError, IOError
+    close(client)
+  end
+
+  def respond(client, head)
+    request_line, *header_lines = head.split("\r\n")
+    method, target, = request_line.to_s.split(' ')
+    headers = {}
+    header_lines.each do |l|
+      k, v = l.split(':', 2)
+      headers[k.strip.downcase] = v.to_s.strip if v
+    end
+
+    if method != 'GET' && method != 'HEAD'
+      reply(client, 405, 'text/plain', "Method not allowed\n")
+    else
+      path = target.to_s.split('?')[0]
+      begin
+        status, type, body, extra = @handler.call(path, headers)
+      rescue StandardError => e
+        # Keep serving other requests (and scrapes) after a handler error
+        puts "exporter error for #{path}: #{e.class}: #{e.message}"
+        status, type, body, extra =
+          500, 'text/plain', "Internal server error\n", nil
       end
+      body = '' if method == 'HEAD'
+      reply(client, status, type, body, extra)
     end
   end
 
-  body.puts "# HELP #{metric}_scrape_duration_seconds " +
-            "Number of seconds to scrape the #{metric} exporter"
-  body.puts "# TYPE #{metric}_scrape_duration_seconds gauge"
-  body.puts "#{metric}_scrape_duration_seconds{domain=\"#{OPTS[:domain]}\", " +
-            "gateway=\"#{OPTS[:gwname]}\"} #{(Time.now-start).to_f}"
+  def reply(client, status, type, body, extra=nil)
+    head = "HTTP/1.1 #{status} #{REASONS[status] || 'OK'}\r\n" +
+           "Content-Type: #{type}\r\n" +
+           "Content-Length: #{body.bytesize}\r\n" +
+           "Connection: close\r\n"
+    (extra || {}).each {|k, v| head << "#{k}: #{v}\r\n"}
+    client.out = head.b << "\r\n" << body.b
+    write(client)
+  end
+
+  def write(client)
+    n = client.io.write_nonblock(client.out, exception: false)
+    return if n == :wait_writable
+    client.out = client.out.byteslice(n..-1)
+    close(client) if client.out.empty?
+  rescue SystemCallError, IOError
+    close(client)
+  end
 
-  if req.accept_encoding.index('gzip')
-    res['Content-Encoding'] = 'gzip'
-    res.body = Zlib.gzip(body.string)
+  def expire_idle
+    now = Time.now
+    @clients.values.each do |c|
+      close(c) if now - c.since > IDLE_TIMEOUT
+    end
+  end
+
+  REASONS = {
+    200 => 'OK',
+    404 => 'Not Found',
+    405 => 'Method Not Allowed',
+    431 => 'Request Header Fields Too Large',
+    500 => 'Internal Server Error'
+  }
+end # class MetricsServer
+
+# Returns the exporter's response to a request for +path+ as [status,
+# content_type, body, extra_headers].
+def export_metrics(path, headers)
+  case path
+  when '/metrics'
+    if headers['accept-encoding'].to_s.index('gzip')
+      [200, 'text/plain; version=0.0.4', OPTS[:renderer].render(true),
+       {'Content-Encoding' => 'gzip'}]
+    else
+      [200, 'text/plain; version=0.0.4', OPTS[:renderer].render]
+    end
+  when '/'
+    title = "Hashpipe #{OPTS[:domain]}://#{OPTS[:gwname]} Exporter"
+    [200, 'text/html',
+     "<html><head><title>#{title}</title></head><body><h1>#{title}</h1>" +
+     '<p><a href="/metrics">Metrics</a></p></body></html>']
   else
-    res.body = body.string
+    [404, 'text/plain', "Not found\n"]
   end
-  res.status = 200
 end
 
 exporter_thread = nil
 
 if OPTS[:prometheus]
   # Require additional packages
-  require 'stringio'
-  require 'webrick'
-  require 'zlib'
+  require 'hashpipe/metrics_renderer'
   # Set defaults as needed
   OPTS[:prometheus]['bind'] ||= '0.0.0.0'
   OPTS[:prometheus]['port'] ||= DEFAULT_EXPORTER_PORT
   OPTS[:prometheus]['name'] ||= 'hashpipe_status_buffer'
   OPTS[:prometheus]['help'] ||= 'Hashpipe status buffer field'
 
-  # Create webrick server (with no logging)
-  OPTS[:exporter] = WEBrick::HTTPServer.new(
-    BindAddress: OPTS[:prometheus]['bind'],
-    Port: OPTS[:prometheus]['port'],
-    AccessLog: [],
-    Logger: WEBrick::Log.new(File::NULL)
-  )
-
-  OPTS[:exporter].mount_proc '/' do |req, res|
-    res.body = '<html><head><title>' +
-               "Hashpipe #{OPTS[:domain]}://#{OPTS[:gwname]} Exporter" +
-               '</title></head><body><h1>' +
-               "Hashpipe #{OPTS[:domain]}://#{OPTS[:gwname]} Exporter" +
-               '</h1><p><a href="/metrics">Metrics</a></p></body></html>'
-    res.status = 200
+  # Collect lock statistics for export
+  STATUS_SET.each do |sb|
+    sb.lock_stats_enabled = true
   end
 
-  OPTS[:exporter].mount_proc '/metrics' do |req, res|
-    export_metrics(req, res)
+  OPTS[:renderer] = Hashpipe::MetricsRenderer.new(
+    OPTS[:prometheus], STATUS_SET.statuses,
+    :domain => OPTS[:domain], :gwname => OPTS[:gwname],
+    :lock_timeout => LOCK_TIMEOUT,
+    :pipeline_stats => lambda do
+      {:snapshot_overruns => PIPELINE_STATS[:snapshot_overruns],
+       :writer_overruns =>
+         defined?(SNAPSHOT_STORES) ? SNAPSHOT_STORES.sum(&:overruns) : 0}
+    end)
+
+  OPTS[:exporter] = MetricsServer.new(OPTS[:prometheus]['bind'],
+                                      OPTS[:prometheus]['port']) do |path, hdrs|
+    export_metrics(path, hdrs)
   end
 
   exporter_thread = Thread.new {OPTS[:exporter].start}
@@ -403,41 +745,96 @@ end
   end
 end
 
-# Updates redis with contents of status_bufs and publishes each statusbuf's key
-# on its "update" channel (if +notify+ is true).
-#
-def update_redis(redis, instance_ids, notify=false)
-  # Pipeline all status buffer updates
-  redis.pipelined do
-    instance_ids.each do |iid|
-      sb = STATUS_BUFS[iid]
-      # Each status buffer update happens in a transaction
-      redis.multi do
-        key = "#{OPTS[:domain]}://#{OPTS[:gwname]}/#{iid}/status"
-        redis.del(key)
-        sb_hash = sb.to_hash
-        redis.mapped_hmset(key, sb_hash)
-        # Expire time must be integer, we always round up
-        redis.expire(key, (3*OPTS[:delay]).ceil) if OPTS[:expire]
-        if notify
-          # Publish "updated" method to notify subscribers
-          channel = "#{OPTS[:domain]}://#{OPTS[:gwname]}/#{iid}/update"
-          redis.publish channel, key
-        end
-      end # redis.multi
-    end # status_bufs,each
-  end # redis.pipelined
-end # def update_redis
-
-# Create Redis object
-redis = Redis.new(:host => OPTS[:server])
-
-# Loop until subscribe_thread stops
-while subscribe_thread.alive?
-  update_redis(redis, OPTS[:instance_ids], OPTS[:notify])
-  # Delay before doing it again
-  sleep OPTS[:delay]
+# Writes snapshots to Redis (see Hashpipe::RedisUpdater)
+REDIS_UPDATER = Hashpipe::RedisUpdater.new(OPTS)
+
+# Returns the index of the Redis writer (0 to OPTS[:connections]-1) for the
+# updates of instance +iid+.
+def shard_for(iid)
+  key = Hashpipe::RedisKeys.status_key(OPTS[:gwname], iid, OPTS[:domain])
+  Hashpipe::RedisKeys.key_shard(key, OPTS[:connections])
+end
+
+# Returns the current CLOCK_MONOTONIC time in seconds.
+def monotonic_now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# Snapshots all status buffers in +status_set+ every OPTS[:delay] seconds
+# and pushes each snapshot into the element of +stores+ given by its
+# instance's shard (see shard_for).  The timer is drift free: each tick is
+# scheduled OPTS[:delay] seconds after the previous tick, not after the end of
+# the previous snapshot.  If ticks are missed, they are counted as snapshot
+# overruns and skipped.  If OPTS[:wait] is true, a change in any status buffer
+# (at least MIN_UPDATE_INTERVAL seconds after the previous snapshot) triggers
+# an early snapshot and restarts the timer.  All status buffers are snapshot at
+# once, so each is locked only for as long as it takes to copy it.  A status
+# buffer that cannot be locked within LOCK_TIMEOUT seconds is skipped (its
+# status key is not refreshed) until the next tick.
+def snapshot_loop(status_set, stores)
+  tick = monotonic_now
+  loop do
+    snapshots = status_set.snapshot(timeout: LOCK_TIMEOUT)
+    # Update derived exporter metrics
+    OPTS[:renderer].observe(snapshots) if OPTS[:renderer]
+    if stores.length == 1
+      stores[0].push(snapshots)
+    else
+      snapshots.group_by {|sb| sb && shard_for(sb.instance_id)}.each do |i,sbs|
+        stores[i].push(sbs) if i
+      end
+    end
+
+    delay = OPTS[:delay]
+    tick += delay
+    now = monotonic_now
+    if tick <= now
+      missed = ((now - tick) / delay).floor + 1
+      PIPELINE_STATS[:snapshot_overruns] += missed
+      tick += missed * delay
+    end
+
+    if OPTS[:wait]
+      # Wait for something to change (but not too often) until the next tick
+      sleep MIN_UPDATE_INTERVAL
+      left = tick - monotonic_now
+      tokens = snapshots.map {|sb| sb && sb.checksum}
+      if left > 0 && status_set.wait_for_change(left, tokens)
+        tick = monotonic_now
+      end
+    else
+      left = tick - monotonic_now
+      sleep left if left > 0
+    end
+  end
+end # def snapshot_loop
+
+# One snapshot store per Redis writer
+SNAPSHOT_STORES = Array.new(OPTS[:connections]) {SnapshotStore.new}
+
+# Start snapshot and Redis writer threads.  An exception in any of them is
+# raised in the main thread (ending the gateway).
+SNAPSHOT_THREAD = Thread.new do
+  snapshot_loop(STATUS_SET, SNAPSHOT_STORES)
 end
+SNAPSHOT_THREAD.abort_on_exception = true
+
+writer_threads = SNAPSHOT_STORES.map do |store|
+  t = Thread.new do
+    # Each writer has its own Redis connection
+    redis = Redis.new(:host => OPTS[:server])
+    loop do
+      REDIS_UPDATER.update(redis, store.take, OPTS[:notify])
+    end
+  end
+  t.abort_on_exception = true
+  t
+end
+
+# Run until subscribe_thread stops
+subscribe_thread.join
+SNAPSHOT_THREAD.kill
+writer_threads.each(&:kill)
 
 # Ensure the web server gets shutdown
 OPTS[:exporter].shutdown if OPTS[:exporter]
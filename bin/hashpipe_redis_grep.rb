@@ -8,15 +8,39 @@
 #   "hashpipe://#{gwname}/#{instance_id}/status"
 #
 #   Example: hashpipe://px1/0/status
+#
+# Statusbin keys (as written by "hashpipe_redis_gateway.rb --format=bin") are
+# also grepped unless a status key exists for the same instance.
+#
+# Statusbin key format:
+#
+#   "hashpipe://#{gwname}/#{instance_id}/statusbin"
+#
+#   Example: hashpipe://px1/0/statusbin
+#
+# Status keys are found with SCAN (so the Redis server is never blocked by
+# KEYS) and all status buffers are fetched in pipelines, so a grep of the
+# whole fleet takes only a few round trips.  The field names of each status
+# key are fetched first (HKEYS) and then only the values of matching fields
+# (HMGET).  With the --lua option, matching fields of status keys are instead
+# selected by a Lua script on the Redis server so only matching fields are
+# sent back in a single round trip.  Each script call is only given keys that
+# hash to the same Redis Cluster slot, so it also works with Redis Cluster.
+# Note that STATUS_KEY_REGEXP is then a (case sensitive) Lua pattern rather
+# than a Ruby Regexp.  Statusbin blobs cannot be decoded by Lua, so they are
+# always fetched and filtered locally.
 
 require 'rubygems'
 require 'optparse'
 require 'redis'
+require 'hashpipe/keys'
+require 'hashpipe/statusbin'
 
 OPTS = {
   :domain    => 'hashpipe',
   :key_glob  => '*',
   :list_keys => false,
+  :lua       => false,
   :server    => 'redishost'
 }
 
@@ -48,6 +72,11 @@ OP = OptionParser.new do |op|
         "List status buffer keys [#{OPTS[:list_keys]}]") do |o|
     OPTS[:list_keys] = o
   end
+  op.on('-L', '--[no-]lua',
+        "Filter fields on server with Lua [#{OPTS[:lua]}]",
+        "STATUS_KEY_REGEXP is then a Lua pattern") do |o|
+    OPTS[:lua] = o
+  end
   op.on('-s', '--server=NAME',
         "Host running redis-server [#{OPTS[:server]}]") do |o|
     OPTS[:server] = o
@@ -61,38 +90,120 @@ end
 OP.parse!
 #p OPTS; exit
 
+# Number of keys to ask for per SCAN call
+SCAN_COUNT = 1000
+
+# Maximum number of status keys to filter per Lua script call.  All keys of a
+# call are in the same hash slot (see Hashpipe::RedisKeys.key_slot).
+LUA_BATCH = 100
+
+# Lua script that returns, for each key in KEYS, a flat Array of the field
+# names and values of the hash whose field names match Lua pattern ARGV[1].
+LUA_FILTER = <<-EOL
+  local out = {}
+  for i, key in ipairs(KEYS) do
+    local h = redis.call('HGETALL', key)
+    local m = {}
+    for j = 1, #h, 2 do
+      if string.find(h[j], ARGV[1]) then
+        m[#m+1] = h[j]
+        m[#m+1] = h[j+1]
+      end
+    end
+    out[i] = m
+  end
+  return out
+EOL
+
 # Create case-INsensitive Regexp object for given (or default) pattern
 pattern = Regexp.new(ARGV[0]||'^', true)
 
 # Create Redis object
 redis = Redis.new(:host => OPTS[:server])
 
-# Get redis keys for hashpipe status buffers
-key_glob = "#{OPTS[:domain]}://*#{OPTS[:key_glob]}*/status"
-rkeys = redis.keys(key_glob).sort
+# Get redis keys for hashpipe status buffers (and statusbin blobs)
+key_glob = "#{OPTS[:domain]}://*#{OPTS[:key_glob]}*/status*"
+rkeys = []
+redis.scan_each(:match => key_glob, :count => SCAN_COUNT) {|k| rkeys << k}
+rkeys = rkeys.grep(%r{/status(bin)?$}).uniq.sort
+# Skip statusbin keys of instances that have status keys
+rkeys -= rkeys.grep(%r{/status$}).map {|k| k + 'bin'}
+hkeys, bkeys = rkeys.partition {|k| k.end_with?('/status')}
+
+# Map each redis key to a Hash of its matching status buffer keys and values
+matches = {}
+
+# Fetch status hashes
+if OPTS[:lua]
+  lua_pattern = ARGV[0] || '^'
+  # A script may only access keys of a single hash slot (Redis Cluster
+  # rejects others with CROSSSLOT), so batch keys by slot.
+  batches = []
+  hkeys.group_by {|k| Hashpipe::RedisKeys.key_slot(k)}.each_value do |slot_keys|
+    batches.concat(slot_keys.each_slice(LUA_BATCH).to_a)
+  end
+  replies = redis.pipelined do |pipe|
+    batches.each do |batch|
+      pipe.eval(LUA_FILTER, :keys => batch, :argv => [lua_pattern])
+    end
+  end
+  batches.flatten.zip(replies.flatten(1)) do |rkey, pairs|
+    matches[rkey] = Hash[*pairs]
+  end
+else
+  # Fetch field names, then only the values of matching fields
+  replies = redis.pipelined do |pipe|
+    hkeys.each {|rkey| pipe.hkeys(rkey)}
+  end
+  fields = {}
+  hkeys.zip(replies) do |rkey, names|
+    fields[rkey] = names.grep(pattern)
+  end
+  fkeys = hkeys.reject {|rkey| fields[rkey].empty?}
+  fkeys.each {|rkey| matches[rkey] = {}}
+  if OPTS[:list_keys]
+    # Values are not listed, so there is no need to fetch them
+    fkeys.each {|rkey| fields[rkey].each {|k| matches[rkey][k] = nil}}
+  else
+    replies = redis.pipelined do |pipe|
+      fkeys.each {|rkey| pipe.hmget(rkey, *fields[rkey])}
+    end
+    fkeys.zip(replies) do |rkey, values|
+      fields[rkey].zip(values) do |k, v|
+        matches[rkey][k] = v unless v.nil?
+      end
+    end
+  end
+end
+
+# Fetch and decode statusbin blobs
+replies = redis.pipelined do |pipe|
+  bkeys.each {|rkey| pipe.get(rkey)}
+end
+bkeys.zip(replies) do |rkey, blob|
+  next unless Hashpipe::StatusBin.statusbin?(blob)
+  matches[rkey] = Hashpipe::StatusBin.decode(blob).select {|k, v| pattern =~ k}
+end
 
 # Create list for status buffer keys (for -l option)
 sbkeylist = []
 
 # For each redis key
 rkeys.each do |rkey|
-  # Get list of status buffer keys that match pattern
-  sbkeys = redis.hkeys(rkey).grep(pattern).sort
+  sbhash = matches[rkey]
   # Skip to next if no keys match
-  next if sbkeys.empty?
+  next if sbhash.nil? || sbhash.empty?
+  sbkeys = sbhash.keys.sort
 
   if OPTS[:list_keys]
     sbkeylist += sbkeys
   else
-    # Get values for status buffer keys that match pattern
-    sbvals = redis.hmget(rkey, *sbkeys)
     # Make cleaned up redis key name
     clean_key = rkey.sub(%r{^#{OPTS[:domain]}://}, '')
-    clean_key.sub!(%r{/status$}, '')
+    clean_key.sub!(%r{/status(bin)?$}, '')
     # Print each matching sbkey with value
-    sbkeys.each_with_index do |sbkey, i|
-      sbval = sbvals[i]
-      printf "%s %s %s\n", clean_key, sbkey, sbval
+    sbkeys.each do |sbkey|
+      printf "%s %s %s\n", clean_key, sbkey, sbhash[sbkey]
     end
   end
 end
@@ -2,12 +2,23 @@
 
 # A curses-based Hashpipe Redis monitor.
 # Transcribed from hashpipe_status_monitor.py.
+#
+# The monitor subscribes to the update channels of the status buffers being
+# monitored and only fetches a status buffer from Redis when an update
+# notification is received for it (i.e. when the gateway is run with
+# --notify).  If no notifications are received for the displayed status buffer
+# (e.g. the gateway was started without --notify or has stopped), it falls
+# back to polling.  Only the parts of the screen whose contents have changed
+# are redrawn.
 
 require 'optparse'
 require 'curses'
 require 'redis'
 require 'hashpipe/keys'
+require 'hashpipe/statusbin'
+require 'hashpipe/curses_cells'
 include Hashpipe::RedisKeys
+include Hashpipe::CursesCells
 
 include Curses
 
@@ -18,8 +29,10 @@ ERRCOL = 3
 
 OPTS = {
   :domain => 'hashpipe',
-  :loose  => false,
-  :server => 'redishost'
+  :loose     => false,
+  :poll      => 0.25,
+  :server    => 'redishost',
+  :subscribe => true
 }
 
 OP = OptionParser.new do |op|
@@ -35,10 +48,18 @@ OP = OptionParser.new do |op|
         "Use loose display format [#{OPTS[:loose]}]") do |o|
     OPTS[:loose] = o
   end
+  op.on('-p', '--poll=SECONDS', Float,
+        "Poll interval without notifications [#{OPTS[:poll]}]") do |o|
+    OPTS[:poll] = o
+  end
   op.on('-s', '--server=NAME',
         "Host running redis-server [#{OPTS[:server]}]") do |o|
     OPTS[:server] = o
   end
+  op.on('-S', '--[no-]subscribe',
+        "Subscribe to update notifications [#{OPTS[:subscribe]}]") do |o|
+    OPTS[:subscribe] = o
+  end
   #op.separator('')
   op.on_tail('-h','--help','Show this message') do
     puts op.help
@@ -53,8 +74,8 @@ begin
   # Try ARGV[0] (for backwards compatibility)
   redis = Redis.new(:host => ARGV[0])
   redis.ping # Test connection
-  # Connect succeeded, drop ARGV[0]
-  ARGV.shift
+  # Connect succeeded, drop ARGV[0] (but remember it for subscribing)
+  OPTS[:server] = ARGV.shift
 rescue
   begin
     # Use OPTS[:server]
@@ -95,6 +116,106 @@ def addstr(win, row, col, string, color=DEFCOL)
   win.color_set(DEFCOL) if color && color != DEFCOL
 end
 
+# Seconds without an update notification for the displayed status buffer
+# after which the monitor falls back to polling.
+NOTIFY_TIMEOUT = 3.0
+
+# Seconds between checks for input, notifications, and polling.
+TICK = 0.05
+
+# Returns the contents of the status buffer of +keyfrag+ ("gwname/instance")
+# from +redis+ as a Hash, or nil if it is not found.
+def fetch_status(redis, keyfrag)
+  data = redis.hgetall(status_key(keyfrag, nil, OPTS[:domain]))
+  # If no hash, look for a statusbin blob (from a "--format=bin" gateway)
+  if data.nil? || data.empty?
+    blob = redis.get(statusbin_key(keyfrag, nil, OPTS[:domain]))
+    if Hashpipe::StatusBin.statusbin?(blob)
+      data = Hashpipe::StatusBin.decode(blob)
+    end
+  end
+  (data.nil? || data.empty?) ? nil : data
+end
+
+# Starts a thread that subscribes (using its own connection) to the update
+# channels of +key_fragments+ and pushes the name of each channel on which an
+# update notification arrives onto +updates+ (a Queue).  If the subscription
+# fails (or ends), the thread just exits and the monitor keeps polling.
+def subscribe_updates(key_fragments, updates)
+  channels = key_fragments.map {|kf| update_channel(kf, nil, OPTS[:domain])}
+  Thread.new do
+    begin
+      Redis.new(:host => OPTS[:server]).subscribe(*channels.uniq) do |on|
+        on.message {|chan, msg| updates << chan}
+      end
+    rescue
+    end
+  end
+end
+
+# Returns the cells (see draw_cells) of the display of +data+ (a Hash, or nil
+# if no data was found) for +keyfrag+ on +win+, last fetched at +time+.
+def status_cells(win, keyfrag, data, time)
+  cells = {}
+
+  # Display main status info
+  onecol = false # Set to true for one-column format
+  col = 2
+  curline = 0
+
+  cells[[curline, col]] = [" Current Status: %s " % keyfrag, KEYCOL]
+
+  curline += 2
+  flip = 0
+  keys = (data || {}).keys.sort
+  keys.delete 'INSTANCE'
+
+  prefix = keys.empty? ? '' : keys[0][0,3]
+
+  keys.each do |k|
+    if OPTS[:loose] && k[0,3] != prefix
+      prefix = k[0,3]
+      curline += flip
+      col = 2
+      flip = 0
+      curline += 1
+    end
+
+    if (curline < win.maxy-3)
+      kstr = '%8s : ' % k
+      cells[[curline, col]] = [kstr, KEYCOL]
+      cells[[curline, col+kstr.length]] = [data[k], VALCOL]
+    else
+      cells[[win.maxy-3, 2]] = ['-- Increase window size --', ERRCOL]
+    end
+
+    if flip == 1 || onecol
+      curline += 1
+      col = 2
+      flip = 0
+    else
+      col = 40
+      flip = 1
+    end
+  end # keys.each
+
+  col = 2
+  if flip == 1 && !onecol
+    curline += 1
+  end
+
+  if data.nil? && curline < win.maxy-2
+    cells[[curline, col]] = ["No data found for #{keyfrag}!", ERRCOL]
+  end
+
+  # Bottom info line
+  cells[[win.maxy-2, col]] = [
+    "Last update: #{time.strftime('%c')}  -  " \
+    "Press 'q' to quit, 0-9 to select", DEFCOL]
+
+  clip_cells(win, cells)
+end
+
 def display_status(redis, key_fragments, fragidx=0)
 
   noecho
@@ -112,92 +233,68 @@ def display_status(redis, key_fragments, fragidx=0)
   init_pair(VALCOL, COLOR_GREEN, COLOR_BLACK)
   init_pair(ERRCOL, COLOR_WHITE, COLOR_RED)
 
+  # Subscribe to update notifications
+  updates = Queue.new
+  subscribe_updates(key_fragments, updates) if OPTS[:subscribe]
+  # Map update channel to time of its most recent notification
+  notified = {}
+  # Update channels with notifications not yet fetched
+  pending = {}
+
+  # State of what is currently displayed
+  shown_frag = nil
+  size = nil
+  data = nil
+  fetched = Time.at(0)
+  prev_cells = {}
+  redraw = false
+
   # Loop
   while run
-    # Get current key fragment
+    # Get current key fragment and its update channel
     keyfrag = key_fragments[fragidx]
-
-    # Refresh status data from redis
-    data = redis.hgetall(status_key(keyfrag, nil, OPTS[:domain]))
-    # Remeber whether we got nil data
-    nil_data = data.nil? || data.empty?
-    # Make sure data is not nil
-    data ||= {}
-
-    # Erase screen (no flicker!)
-    stdscr.erase
-
-    # Draw border
-    stdscr.box(0,0)
-
-    # Display main status info
-    onecol = false # Set to true for one-column format
-    col = 2
-    curline = 0
-
-    addstr(stdscr, curline, col, " Current Status: %s " % keyfrag, KEYCOL)
-
-    curline += 2
-    flip = 0
-    keys = data.keys.sort
-    keys.delete 'INSTANCE'
-
-    prefix = keys.empty? ? '' : keys[0][0,3]
-
-    keys.each do |k|
-      if OPTS[:loose] && k[0,3] != prefix
-        prefix = k[0,3]
-        curline += flip
-        col = 2
-        flip = 0
-        #stdscr.addch(curline, 0, ACS_LTEE)
-        #stdscr.hline(curline, 1, ACS_HLINE, xmax-2)
-        #stdscr.addch(curline, xmax-1, ACS_RTEE)
-        curline += 1
-      end
-
-      v = data[k]
-      if (curline < stdscr.maxy-3)
-        addstr(stdscr, curline, col, '%8s : ' % k, KEYCOL)
-        addstr(stdscr, nil, nil, v, VALCOL)
-      else
-        addstr(stdscr, stdscr.maxy-3, 2, ' ' * (stdscr.maxx - 3))
-        addstr(stdscr, stdscr.maxy-3, 2,
-               '-- Increase window size --', ERRCOL)
-      end
-
-      if flip == 1 || onecol
-        curline += 1
-        col = 2
-        flip = 0
-      else
-        col = 40
-        flip = 1
-      end
-    end # keys.each
-
-    col = 2
-    if flip == 1 && !onecol
-      curline += 1
+    channel = update_channel(keyfrag, nil, OPTS[:domain])
+
+    # Collect update notifications
+    now = Time.now
+    until updates.empty?
+      chan = updates.pop
+      notified[chan] = now
+      pending[chan] = true
     end
 
-    if nil_data
-      addstr(stdscr, curline, col, ' ' * (stdscr.maxx - col - 1))
-      addstr(stdscr, curline, col,
-             "No data found for #{key_fragments[fragidx]}!",
-             ERRCOL)
+    # Refresh status data from redis if it has been updated, if another status
+    # buffer is selected, or (without recent notifications) if it is time to
+    # poll.
+    polling = !notified[channel] || now - notified[channel] > NOTIFY_TIMEOUT
+    if pending.delete(channel) || keyfrag != shown_frag ||
+       (polling && now - fetched >= OPTS[:poll])
+      data = fetch_status(redis, keyfrag)
+      fetched = now
+      shown_frag = keyfrag
+      redraw = true
     end
 
-    # Bottom info line
-    addstr(stdscr, stdscr.maxy-2, col,
-           "Last update: #{Time.now.strftime('%c')}  -  " \
-           "Press 'q' to quit, 0-9 to select")
+    # Start over with a fresh screen if the window size has changed
+    if size != [stdscr.maxy, stdscr.maxx]
+      size = [stdscr.maxy, stdscr.maxx]
+      stdscr.erase
+      prev_cells = {}
+      redraw = true
+    end
 
-    # Redraw screen
-    stdscr.refresh
+    if redraw
+      # Draw border (only needed after erasing)
+      stdscr.box(0,0) if prev_cells.empty?
+      cells = status_cells(stdscr, keyfrag, data, fetched)
+      # Redraw screen (only the changed cells)
+      stdscr.refresh if draw_cells(stdscr, cells, prev_cells)
+      prev_cells = cells
+      redraw = false
+    end
 
     # Sleep a bit
-    sleep 0.25
+    sleep TICK
 
     # Look for input
     while c = stdscr.getch
@@ -232,6 +329,8 @@ def display_status(redis, key_fragments, fragidx=0)
       # Space or ctrl-L or ctrl-R uses the harsher #clear
       when ' ', 'L'.ord-'A'.ord+1, 'R'.ord-'A'.ord+1
         stdscr.clear
+        prev_cells = {}
+        redraw = true
       ## Key code diagnostics
       #else
       #  addstr(stdscr, 4, 2, ' ' * (stdscr.maxx-2))
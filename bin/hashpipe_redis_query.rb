@@ -0,0 +1,222 @@
+#!/usr/bin/env ruby
+
+# hashpipe_redis_query.rb - A script for querying fields of all Hashpipe status
+#                           buffers stored in Redis by, for example,
+#                           hashpipe_redis_gateway.rb, and summarizing them.
+#
+# The given fields are fetched from every status key (and statusbin key) that
+# matches the key glob using one pipeline, so querying a whole fleet takes
+# only a few round trips.  For each field, the numeric values are summarized
+# per gateway (and over all gateways): count, min, max, sum, mean, standard
+# deviation, and outliers (instances whose value is more than a given number
+# of standard deviations from the mean of the other instances).
+#
+# Status key format:
+#
+#   "hashpipe://#{gwname}/#{instance_id}/status"
+#
+#   Example: hashpipe://px1/0/status
+
+require 'rubygems'
+require 'optparse'
+require 'redis'
+require 'hashpipe/keys'
+require 'hashpipe/statusbin'
+
+OPTS = {
+  :domain   => 'hashpipe',
+  :key_glob => '*',
+  :group    => true,
+  :outliers => 3.0,
+  :values   => false,
+  :server   => 'redishost'
+}
+
+OP = OptionParser.new do |op|
+  op.program_name = File.basename($0)
+
+  op.banner = "Usage: #{op.program_name} [OPTIONS] FIELD [...]"
+  op.separator('')
+  op.separator('Summarize Hashpipe status buffer fields in a Redis server.')
+  op.separator('The given FIELDs are fetched from all hashpipe status buffers')
+  op.separator('cached in the server and their numeric values are summarized')
+  op.separator('for each gateway and for all gateways ("*").  Outliers are')
+  op.separator('instances at least SIGMA standard deviations (of the other')
+  op.separator('instances) from the mean of the other instances.  At least')
+  op.separator('three numeric values are needed to find outliers, and two or')
+  op.separator('more similar outliers can hide each other in small groups.')
+  op.separator('FIELDs are case sensitive (and usually upper case).')
+  op.separator('')
+  op.separator('Options:')
+  op.on('-D', '--domain=DOMAIN',
+        "Domain for Redis channels/keys [#{OPTS[:domain]}]") do |o|
+    OPTS[:domain] = o
+  end
+  op.on('-g', '--[no-]group',
+        "Summarize each gateway separately [#{OPTS[:group]}]") do |o|
+    OPTS[:group] = o
+  end
+  op.on('-k', '--key-glob=GLOB',
+        "Redis key glob pattern [#{OPTS[:key_glob]}]",
+        "Key glob used will be 'hashpipe://*GLOB*/status'") do |o|
+    OPTS[:key_glob] = o
+  end
+  op.on('-o', '--outliers=SIGMA', Float,
+        "Outlier threshold (0 disables) [#{OPTS[:outliers]}]") do |o|
+    OPTS[:outliers] = o
+  end
+  op.on('-s', '--server=NAME',
+        "Host running redis-server [#{OPTS[:server]}]") do |o|
+    OPTS[:server] = o
+  end
+  op.on('-v', '--[no-]values',
+        "Also print each instance's values [#{OPTS[:values]}]") do |o|
+    OPTS[:values] = o
+  end
+  #op.separator('')
+  op.on_tail('-h','--help','Show this message') do
+    puts op.help
+    exit
+  end
+end
+OP.parse!
+#p OPTS; exit
+
+if ARGV.empty?
+  puts OP
+  exit 1
+end
+fields = ARGV
+
+# Number of keys to ask for per SCAN call
+SCAN_COUNT = 1000
+
+# Summary statistics of the values of one field for one group of instances.
+# Uses Welford's method so that the mean and variance are computed in the same
+# single pass as the other statistics.
+class Summary
+  attr_reader :count, :min, :max, :sum, :mean, :non_numeric
+
+  def initialize
+    @count = 0
+    @sum = 0.0
+    @mean = 0.0
+    @m2 = 0.0
+    @non_numeric = 0
+    # [instance, value] pairs for finding outliers
+    @values = []
+  end
+
+  # Adds +value+ (a String or nil) of +instance+.
+  def add(instance, value)
+    return if value.nil?
+    v = Float(value) rescue nil
+    if v.nil?
+      @non_numeric += 1
+      return
+    end
+    @values << [instance, v]
+    @count += 1
+    @min = v if @min.nil? || v < @min
+    @max = v if @max.nil? || v > @max
+    @sum += v
+    delta = v - @mean
+    @mean += delta / @count
+    @m2 += delta * (v - @mean)
+  end
+
+  def stddev
+    @count > 1 ? Math.sqrt(@m2 / (@count - 1)) : 0.0
+  end
+
+  # Returns the [instance, value] pairs at least +sigma+ standard deviations
+  # from the mean, where both the mean and the standard deviation are those of
+  # the other values (leave-one-out).  Including the value itself would let a
+  # single large outlier inflate the standard deviation enough to hide itself
+  # (with n values, no value can be more than (n-1)/sqrt(n) standard
+  # deviations from their mean).  With fewer than three values there is no
+  # standard deviation of the others, so no outliers are returned.
+  def outliers(sigma)
+    return [] if sigma <= 0 || @count < 3 || @min == @max
+    n = @count
+    @values.select do |_, v|
+      # Remove v from the running mean and sum of squared deviations
+      mean = (@sum - v) / (n - 1)
+      m2 = @m2 - (v - @mean) ** 2 * n / (n - 1)
+      sd = m2 > 0 ? Math.sqrt(m2 / (n - 2)) : 0.0
+      (v - mean).abs > 0 && (v - mean).abs >= sigma * sd
+    end
+  end
+end # class Summary
+
+# Create Redis object
+redis = Redis.new(:host => OPTS[:server])
+
+# Get redis keys for hashpipe status buffers (and statusbin blobs)
+key_glob = "#{OPTS[:domain]}://*#{OPTS[:key_glob]}*/status*"
+rkeys = []
+redis.scan_each(:match => key_glob, :count => SCAN_COUNT) {|k| rkeys << k}
+rkeys = rkeys.select {|k| Hashpipe::RedisKeys.parse_status_key(k)}.uniq.sort
+# Skip statusbin keys of instances that have status keys
+rkeys -= rkeys.grep(%r{/status$}).map {|k| k + 'bin'}
+
+# Fetch the fields from all status buffers in one pipeline
+replies = redis.pipelined do |pipe|
+  rkeys.each do |rkey|
+    if rkey.end_with?('bin')
+      pipe.get(rkey)
+    else
+      pipe.hmget(rkey, *fields)
+    end
+  end
+end
+
+# Map each gateway (and '*' for all gateways) to a Hash mapping each field to
+# its Summary.
+summaries = Hash.new do |h, gw|
+  h[gw] = Hash.new {|hh, f| hh[f] = Summary.new}
+end
+
+rkeys.zip(replies) do |rkey, reply|
+  gwname, instance_id, = Hashpipe::RedisKeys.parse_status_key(rkey)
+  if rkey.end_with?('bin')
+    next unless Hashpipe::StatusBin.statusbin?(reply)
+    values = Hashpipe::StatusBin.decode(reply).values_at(*fields)
+  else
+    values = reply
+  end
+
+  instance = "#{gwname}/#{instance_id}"
+  if OPTS[:values]
+    fields.each_with_index do |f, i|
+      printf "%s %s %s\n", instance, f, values[i] if values[i]
+    end
+  end
+
+  groups = OPTS[:group] ? [gwname, '*'] : ['*']
+  fields.each_with_index do |f, i|
+    groups.each {|gw| summaries[gw][f].add(instance, values[i])}
+  end
+end
+
+puts if OPTS[:values] && !summaries.empty?
+
+# Print summaries sorted by field then gateway (with '*' last)
+FMT = "%-8s %-12s %5s %12s %12s %14s %12s %12s %s\n"
+printf FMT, 'FIELD', 'GATEWAY', 'COUNT', 'MIN', 'MAX', 'SUM', 'MEAN',
+            'STDDEV', 'OUTLIERS'
+gateways = summaries.keys.sort_by {|gw| [gw == '*' ? 1 : 0, gw]}
+fields.each do |f|
+  gateways.each do |gw|
+    s = summaries[gw][f]
+    next if s.count == 0 && s.non_numeric == 0
+    outliers = s.outliers(OPTS[:outliers]).map {|inst, v| "#{inst}=#{'%g' % v}"}
+    outliers << "(#{s.non_numeric} non-numeric)" if s.non_numeric > 0
+    if s.count == 0
+      printf FMT, f, gw, 0, '-', '-', '-', '-', '-', outliers.join(' ')
+    else
+      printf FMT, f, gw, s.count, '%g' % s.min, '%g' % s.max, '%g' % s.sum,
+             '%g' % s.mean, '%g' % s.stddev, outliers.join(' ')
+    end
+  end
+end
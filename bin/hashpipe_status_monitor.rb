@@ -2,12 +2,23 @@
 
 # A curses-based Hashpipe status monitor.
 # Transcribed from guppi_status_monitor.py.
+#
+# Usage: hashpipe_status_monitor.rb [-l] [INSTANCE_ID]
+#        hashpipe_status_monitor.rb [-l] -a [INSTANCE_ID ...]
+#
+# The -l option selects a "loose" display format, which separates groups of
+# keys with different three character prefixes by a blank line.  The -a option
+# selects the dashboard mode, which shows all given instances (or all existing
+# instances if none are given) at once, each in its own tile.  With -l, the
+# keys of each tile are grouped the same way.
 
 require 'rubygems'
 require 'curses'
 require 'hashpipe'
+require 'hashpipe/curses_cells'
 
 include Curses
+include Hashpipe::CursesCells
 
 DEFCOL = 0
 KEYCOL = 1
@@ -55,6 +66,7 @@ def display_status(stat, instance_id)
   # Loop 
   while run
     # Refresh status daat from buffer
+    token = stat.checksum
     data = stat.to_hash
 
     # Get instance_id (as a string) from status buffer
@@ -125,8 +137,9 @@ def display_status(stat, instance_id)
     # Redraw screen
     stdscr.refresh
 
-    # Sleep a bit
-    sleep 0.25 
+    # Sleep a bit, then wait (up to a quarter second) for a change
+    sleep 0.05
+    stat.wait_for_change(0.2, token)
 
     # Look for input
     while c = stdscr.getch
@@ -171,11 +184,202 @@ def display_status(stat, instance_id)
   end # while run
 end # display_status
 
-if ARGV[0] == '-l'
-  LOOSE = true
-  ARGV.shift
-else
-  LOOSE = false
+# Hashpipe supports instance ids 0 to MAX_INSTANCES-1.
+MAX_INSTANCES = 64
+
+# Minimum width of an instance's tile in the dashboard.
+TILE_WIDTH = 38
+
+# Returns the cells (see draw_cells) of the tile showing +data+ (the contents
+# of a status buffer as a Hash) whose keys, sorted, are +keys+.  The tile's top
+# left corner is at +row+, +col+ and it is +width+ columns by +height+ rows.
+# In the loose format, groups of keys with different three character prefixes
+# are separated by a blank row (as in display_status).
+def tile_cells(data, keys, row, col, width, height)
+  cells = {}
+  instance_str = data['INSTANCE'] || '?'
+  cells[[row, col]] = [" Instance %s " % instance_str, KEYCOL]
+
+  # Row (relative to the first key's row) of each key
+  key_rows = []
+  nused = 0
+  prefix = keys.empty? ? '' : keys[0][0,3]
+  keys.each do |k|
+    if LOOSE && k[0,3] != prefix
+      prefix = k[0,3]
+      nused += 1
+    end
+    key_rows << nused
+    nused += 1
+  end
+
+  # Leave a row for the overflow message if all keys don't fit
+  nrows = height - 1
+  nrows -= 1 if nused > nrows
+  nshown = key_rows.count {|r| r < nrows}
+
+  keys.first(nshown).each_with_index do |k, i|
+    kstr = '%8s : ' % k
+    krow = row + 1 + key_rows[i]
+    cells[[krow, col]] = [kstr, KEYCOL]
+    cells[[krow, col+kstr.length]] = [data[k][0, width-kstr.length-1], VALCOL]
+  end
+
+  if nshown < keys.length && height >= 2
+    cells[[row+height-1, col]] = [
+      "-- #{keys.length-nshown} more --"[0, width-1], ERRCOL]
+  end
+
+  cells
+end
+
+# Displays a dashboard with a tile for each status buffer in +set+ (a
+# Hashpipe::StatusSet).  All status buffers are snapshotted together (only
+# when at least one has changed).  The contents and sorted key list of each
+# tile are cached between frames and only rebuilt when that status buffer's
+# checksum changes, and only cells whose contents changed are redrawn.
+def display_dashboard(set)
+  noecho
+  start_color
+  stdscr.keypad true
+  stdscr.nodelay = true
+
+  run = true
+
+  # Hide the cursor
+  Curses.curs_set(0)
+
+  # Look like gbtstatus (why not?)
+  init_pair(KEYCOL, COLOR_CYAN,  COLOR_BLACK)
+  init_pair(VALCOL, COLOR_GREEN, COLOR_BLACK)
+  init_pair(ERRCOL, COLOR_WHITE, COLOR_RED)
+
+  n = set.statuses.length
+  # Per instance caches of checksum, data, sorted keys, and tile cells
+  checksums = Array.new(n)
+  datas = Array.new(n) { {} }
+  sorted_keys = Array.new(n) { [] }
+  tiles = Array.new(n)
+
+  tokens = nil
+  changed = true
+  size = nil
+  prev_cells = {}
+
+  # Loop
+  while run
+    # Start over with a fresh screen (and tiles) if the window size changed
+    if size != [stdscr.maxy, stdscr.maxx]
+      size = [stdscr.maxy, stdscr.maxx]
+      stdscr.erase
+      prev_cells = {}
+      tiles.fill(nil)
+    end
+
+    # Tile geometry
+    ncols = [[(stdscr.maxx-2) / TILE_WIDTH, 1].max, n].min
+    nrows = (n + ncols - 1) / ncols
+    width = (stdscr.maxx-2) / ncols
+    height = (stdscr.maxy-3) / nrows
+
+    # Snapshot all status buffers if any have changed
+    if changed
+      snaps = set.snapshot(timeout: 0.1)
+      snaps.each_with_index do |snap, i|
+        # Keep the previous contents of a status buffer that stayed locked
+        next if snap.nil? || snap.checksum == checksums[i]
+        checksums[i] = snap.checksum
+        data = snap.to_hash
+        # Only re-sort keys if the set of keys changed
+        if data.length != datas[i].length ||
+           !data.each_key.all? {|k| datas[i].key?(k)}
+          sorted_keys[i] = data.keys.sort
+          sorted_keys[i].delete 'INSTANCE'
+        end
+        datas[i] = data
+        tiles[i] = nil
+      end
+      tokens = checksums.dup
+    end
+
+    # Build cells from (re)built tiles
+    cells = {}
+    n.times do |i|
+      row = 1 + (i / ncols) * height
+      col = 1 + (i % ncols) * width
+      tiles[i] ||= tile_cells(datas[i], sorted_keys[i], row, col+1,
+                              width-1, height)
+      cells.merge!(tiles[i])
+    end
+
+    # Title and bottom info line
+    cells[[0, 2]] = [" Hashpipe Status: %d instances " % n, KEYCOL]
+    cells[[stdscr.maxy-2, 2]] = [
+      "Last update: #{Time.now.strftime('%c')}  -  Press 'q' to quit", DEFCOL]
+    cells = clip_cells(stdscr, cells)
+
+    # Draw border (only needed after erasing)
+    stdscr.box(0,0) if prev_cells.empty?
+    # Redraw screen (only the changed cells)
+    stdscr.refresh if draw_cells(stdscr, cells, prev_cells)
+    prev_cells = cells
+
+    # Sleep a bit, then wait (up to a quarter second) for a change
+    sleep 0.05
+    changed = !!set.wait_for_change(0.2, tokens)
+
+    # Look for input
+    while c = stdscr.getch
+      case c
+      when 'q'
+        run = false
+      # Space or ctrl-L or ctrl-R uses the harsher #clear
+      when ' ', 'L'.ord-'A'.ord+1, 'R'.ord-'A'.ord+1
+        stdscr.clear
+        prev_cells = {}
+      end # case
+
+      c = stdscr.getch
+    end # while c != ERR
+  end # while run
+end # display_dashboard
+
+LOOSE = !!ARGV.delete('-l')
+DASHBOARD = !!ARGV.delete('-a')
+
+if DASHBOARD
+  # Get instance_ids, defaulting to all existing instances
+  instance_ids = ARGV.map {|a| Integer(a) rescue nil}.compact
+  if instance_ids.empty?
+    instance_ids = (0...MAX_INSTANCES).select {|i| Hashpipe::Status.exists?(i)}
+  end
+  if instance_ids.empty?
+    puts "No status buffers found"
+    exit 1
+  end
+
+  # Connect to Hashpipe status buffers
+  begin
+    set = Hashpipe::StatusSet.new(instance_ids, false)
+  rescue
+    puts "Error connecting to status buffers for instances #{instance_ids}"
+    exit 1
+  end
+
+  # Initialize screen and call the dashboard func
+  init_screen
+  begin
+    begin
+      display_dashboard(set)
+    ensure
+      close_screen
+    end
+  rescue => e
+    p e
+    puts e.backtrace
+    puts "Error reading from status buffers"
+  end
+  exit
 end
 
 # Get instance_id
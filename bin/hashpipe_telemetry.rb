@@ -0,0 +1,312 @@
+#!/usr/bin/env ruby
+
+# hashpipe_telemetry.rb - Store host performance telemetry in a Hashpipe
+#                         status buffer.
+#
+# Samples several host level sources of performance data every SECONDS
+# seconds (on a fixed-rate timer) and stores the results in a Hashpipe status
+# buffer (using Status#hput_many, i.e. under one lock per sample) so that they
+# can be correlated with the pipeline's own status (e.g. packet drops) and be
+# picked up by hashpipe_redis_gateway.rb.  This is a companion to
+# hashpipe_irqps.rb.  The sources and the status buffer keys they produce are:
+#
+#   /proc/softirqs (always)
+#     SIRXSUM, SITXSUM   - NET_RX and NET_TX softirqs per second (all CPUs)
+#     SIRX%03d, SITX%03d - NET_RX and NET_TX softirqs per second of each CPU
+#                          given with --cpus
+#
+#   /proc/stat (always)
+#     CPUBALL            - Busy percentage of all CPUs
+#     CPUB%03d           - Busy percentage of each CPU given with --cpus
+#     CPUS%03d           - Softirq (and hardirq) percentage of each CPU given
+#                          with --cpus
+#
+#   /proc/net/dev (with --nic)
+#     NICNAME            - Name of the NIC
+#     NICRXBPS, NICRXPPS - Received bytes and packets per second
+#     NICRXDPS           - Received packets dropped per second
+#     NICRXEPS           - Receive errors per second
+#     NICRXFPS           - Receive FIFO (ring) overruns per second
+#     NICTXPPS           - Transmitted packets per second
+#
+#   /sys/devices/system/node/node*/numastat (always, if present)
+#     NMIS%02d           - numa_miss allocations per second of each NUMA node
+#     NOTH%02d           - other_node allocations per second of each NUMA node
+#
+#   /proc/PID/numa_maps (with --pid)
+#     NMEM%02d           - MiB of the process's memory on each NUMA node
+#
+# Rates are calculated over the last sampling interval, so no rate keys are
+# stored until the second sample.  The --cpus option is typically given the
+# cores that the pipeline's threads are pinned to, --nic the capture NIC, and
+# --pid the pipeline's process id.  All files are kept open (and read into
+# reused buffers) for the life of the collector and only the needed lines are
+# parsed, so each sample is cheap.
+#
+# Usage: hashpipe_telemetry.rb [OPTIONS] [SECONDS]
+#
+# Example:
+#
+#     $ hashpipe_telemetry.rb -I 0 -C 4-7 -n eth2 -p $(pgrep hashpipe) 1
+
+require 'optparse'
+require 'hashpipe'
+
+OPTS = {
+  :cpus     => [],
+  :instance => 0,
+  :nic      => nil,
+  :pid      => nil,
+  :verbose  => false
+}
+
+OP = OptionParser.new do |op|
+  op.program_name = File.basename($0)
+
+  op.banner = "Usage: #{op.program_name} [OPTIONS] [SECONDS]"
+  op.separator('')
+  op.separator('Store host performance telemetry in a Hashpipe status buffer')
+  op.separator('every SECONDS (default 1) seconds.')
+  op.separator('')
+  op.separator('Options:')
+  op.on('-C', '--cpus=C[,C[...]]', Array,
+        "CPUs (e.g. 4-7,12) to report on [none]") do |o|
+    OPTS[:cpus] = o.map do |c|
+      first, last = c.split('-', 2).map {|x| Integer(x) rescue 0}
+      (first..(last||first)).to_a
+    end.flatten.uniq.sort
+  end
+  op.on('-I', '--instance=N', Integer,
+        "Instance (status buffer) to store into [#{OPTS[:instance]}]") do |o|
+    OPTS[:instance] = o
+  end
+  op.on('-n', '--nic=NAME',
+        "Network interface to report on [none]") do |o|
+    OPTS[:nic] = o
+  end
+  op.on('-p', '--pid=PID', Integer,
+        "Process to report NUMA placement of [none]") do |o|
+    OPTS[:pid] = o
+  end
+  op.on('-v', '--[no-]verbose',
+        "Print the values after each sample [#{OPTS[:verbose]}]") do |o|
+    OPTS[:verbose] = o
+  end
+  #op.separator('')
+  op.on_tail('-h','--help','Show this message') do
+    puts op.help
+    exit
+  end
+end
+OP.parse!
+#p OPTS; exit
+
+SECONDS = Float(ARGV[0]||1) rescue 1.0
+
+# A file (typically in /proc or /sys) that is kept open and re-read into a
+# reused buffer.
+class ProcFile
+  def initialize(path)
+    @file = File.open(path)
+    @buf = String.new
+  end
+
+  # Returns the current contents of the file (in a reused String).
+  def read
+    @file.rewind
+    @file.read(nil, @buf)
+  end
+
+  # Returns the whitespace separated fields of the line starting with +label+
+  # (after any leading spaces), excluding the label, from +buf+ (as returned
+  # by #read).  Returns nil if there is no such line.
+  def self.fields(buf, label)
+    i = buf.index(label)
+    # Make sure the match is at the start of a line
+    while i && i > 0 && buf[i-1] != "\n" && buf[i-1] != ' '
+      i = buf.index(label, i+1)
+    end
+    return nil unless i
+    eol = buf.index("\n", i) || buf.length
+    buf[i+label.length...eol].split
+  end
+end # class ProcFile
+
+# Base class for telemetry sources.  Subclasses implement #sample, which
+# returns a Hash of status buffer keys and values.
+class Source
+  # Returns a Hash mapping the keys of +counters+ (a Hash of monotonically
+  # increasing counts) to their rates per second since the previous call, or
+  # an empty Hash for the first call.
+  def rates(counters, now)
+    prev, @prev = @prev, [now, counters]
+    return {} unless prev
+    dt = now - prev[0]
+    h = {}
+    counters.each {|k, v| h[k] = (v - prev[1][k]) / dt if prev[1][k]}
+    h
+  end
+end
+
+# NET_RX and NET_TX softirqs from /proc/softirqs.
+class SoftirqSource < Source
+  def initialize(cpus)
+    @file = ProcFile.new('/proc/softirqs')
+    buf = @file.read
+    # Map CPU number to column
+    columns = buf[0, buf.index("\n")].split.map {|c| c.sub('CPU', '').to_i}
+    @cpus = cpus.map {|c| [c, columns.index(c)]}.select {|c, col| col}
+  end
+
+  def sample(now)
+    buf = @file.read
+    counters = {}
+    [['NET_RX:', 'SIRX'], ['NET_TX:', 'SITX']].each do |label, prefix|
+      counts = ProcFile.fields(buf, label)
+      next unless counts
+      counts.map!(&:to_i)
+      counters["#{prefix}SUM"] = counts.inject(0, :+)
+      @cpus.each {|c, col| counters['%s%03d' % [prefix, c]] = counts[col]}
+    end
+    rates(counters, now)
+  end
+end # class SoftirqSource
+
+# CPU utilization from /proc/stat.
+class CpuSource < Source
+  # Indexes of the fields of a "cpu" line
+  IDLE, IOWAIT, IRQ, SOFTIRQ = 3, 4, 5, 6
+
+  def initialize(cpus)
+    @file = ProcFile.new('/proc/stat')
+    @cpus = cpus
+    @prev = {}
+  end
+
+  def sample(now)
+    buf = @file.read
+    h = {}
+    [['ALL', 'cpu ']].concat(@cpus.map {|c| ['%03d' % c, "cpu#{c} "]}
+    ).each do |suffix, label|
+      fields = ProcFile.fields(buf, label)
+      next unless fields
+      fields = fields.map(&:to_i)
+      # Exclude guest time, which is already included in user time
+      total = fields[0, 8].inject(0, :+)
+      idle = fields[IDLE] + fields[IOWAIT]
+      irq = fields[IRQ] + fields[SOFTIRQ]
+      prev, @prev[suffix] = @prev[suffix], [total, idle, irq]
+      next unless prev && total > prev[0]
+      dt = (total - prev[0]).to_f
+      h["CPUB#{suffix}"] = 100 * (dt - (idle - prev[1])) / dt
+      h["CPUS#{suffix}"] = 100 * (irq - prev[2]) / dt if suffix != 'ALL'
+    end
+    h
+  end
+end # class CpuSource
+
+# Receive and transmit statistics of one NIC from /proc/net/dev.
+class NicSource < Source
+  # Key and field index (after the "NAME:" label) of each counter
+  COUNTERS = {
+    'NICRXBPS' => 0,
+    'NICRXPPS' => 1,
+    'NICRXEPS' => 2,
+    'NICRXDPS' => 3,
+    'NICRXFPS' => 4,
+    'NICTXPPS' => 9
+  }
+
+  def initialize(nic)
+    @nic = nic
+    @label = "#{nic}:"
+    @file = ProcFile.new('/proc/net/dev')
+  end
+
+  def sample(now)
+    fields = ProcFile.fields(@file.read, @label)
+    return {} unless fields
+    counters = {}
+    COUNTERS.each {|k, i| counters[k] = fields[i].to_i}
+    rates(counters, now).merge!('NICNAME' => @nic)
+  end
+end # class NicSource
+
+# NUMA allocation statistics from /sys/devices/system/node/node*/numastat and,
+# if a process id is given, the placement of that process's memory from
+# /proc/PID/numa_maps.
+class NumaSource < Source
+  def initialize(pid=nil)
+    @nodes = Dir['/sys/devices/system/node/node[0-9]*'].map do |d|
+      [d[/\d+\z/].to_i, ProcFile.new("#{d}/numastat")]
+    end.sort
+    @numa_maps = pid && ProcFile.new("/proc/#{pid}/numa_maps")
+  end
+
+  def sample(now)
+    counters = {}
+    @nodes.each do |node, file|
+      buf = file.read
+      counters['NMIS%02d' % node] = ProcFile.fields(buf, 'numa_miss ')[0].to_i
+      counters['NOTH%02d' % node] = ProcFile.fields(buf, 'other_node ')[0].to_i
+    end
+    h = rates(counters, now)
+    h.merge!(memory_placement) if @numa_maps
+    h
+  end
+
+  # Returns a Hash mapping NMEM%02d keys to the MiB of the process's memory on
+  # each node.
+  def memory_placement
+    kib = Hash.new(0)
+    @numa_maps.read.each_line do |line|
+      page_kib = line[/kernelpagesize_kB=(\d+)/, 1].to_i
+      line.scan(/ N(\d+)=(\d+)/) {|n, pages| kib[n.to_i] += pages.to_i * page_kib}
+    end
+    h = {}
+    @nodes.each {|node, _| h['NMEM%02d' % node] = kib[node] / 1024.0}
+    h
+  end
+end # class NumaSource
+
+begin
+  STATUS = Hashpipe::Status.new(OPTS[:instance], false)
+rescue
+  puts "Error connecting to status buffer for instance #{OPTS[:instance]}"
+  exit 1
+end
+
+begin
+  sources = [SoftirqSource.new(OPTS[:cpus]), CpuSource.new(OPTS[:cpus])]
+  sources << NicSource.new(OPTS[:nic]) if OPTS[:nic]
+  sources << NumaSource.new(OPTS[:pid])
+rescue SystemCallError => e
+  puts "Error opening telemetry source: #{e}"
+  exit 1
+end
+
+def monotonic_now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+next_time = monotonic_now
+begin
+  loop do
+    now = monotonic_now
+    h = {}
+    sources.each {|src| h.merge!(src.sample(now))}
+    STATUS.hput_many(h) unless h.empty?
+    if OPTS[:verbose]
+      h.keys.sort.each {|k| printf "%-8s = %s\n", k, h[k]}
+      puts
+      STDOUT.flush
+    end
+
+    # Fixed-rate (drift free) timer; skip missed ticks
+    next_time += SECONDS
+    next_time = monotonic_now + SECONDS if next_time < monotonic_now
+    delay = next_time - monotonic_now
+    sleep delay if delay > 0
+  end
+rescue Interrupt
+end
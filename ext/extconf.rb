@@ -26,5 +26,11 @@ exit unless have_header('hashpipe_status.h')
 exit unless have_library('hashpipestatus',
                          'hashpipe_status_attach')
 
+# Check for rb_interned_str (Ruby 3.0+) for deduplicated frozen Hash keys
+have_func('rb_interned_str', 'ruby.h')
+
+# Check for IO::Buffer C API (Ruby 3.1+) for zero-copy views of status buffers
+have_header('ruby/io/buffer.h')
+
 # Generate Makefile
 create_makefile("hashpipe")
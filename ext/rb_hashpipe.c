@@ -8,18 +8,94 @@
  * rb_hashpipe.c
  */
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include <hashpipe_status.h>
 #include <fitshead.h>
 
 #include "ruby.h"
 
+#include "ruby/encoding.h"
 #include "ruby/thread.h"
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif
 #define rb_thread_blocking_region rb_thread_call_without_gvl
 #define BLOCKING_TYPE void *
 
+// Match conversion functions to int8 type from fitshead.h
+#if __SIZEOF_INT__ == 8
+#define INT82NUM  INT2NUM
+#define UINT82NUM UINT2NUM
+#define NUM2INT8  NUM2INT
+#define NUM2UINT8 NUM2UINT
+#elif __SIZEOF_LONG__ == 8
+#define INT82NUM  LONG2NUM
+#define UINT82NUM ULONG2NUM
+#define NUM2INT8  NUM2LONG
+#define NUM2UINT8 NUM2ULONG
+#elif __SIZEOF_LONG_LONG__ == 8
+#define INT82NUM  LL2NUM
+#define UINT82NUM ULL2NUM
+#define NUM2INT8  NUM2LL
+#define NUM2UINT8 NUM2ULL
+#else
+#error cannot determine 8 byte integer type
+#endif
+
+struct rb_hps_attachment;
+
+// Per-object state of a Hashpipe::Status object.
+typedef struct rb_hps {
+  // The status buffer itself
+  hashpipe_status_t s;
+  // Shared attachment that s is a copy of (NULL if detached or a Snapshot)
+  // and the links of this object in its list of users
+  struct rb_hps_attachment * att;
+  struct rb_hps * att_prev;
+  struct rb_hps * att_next;
+  // Optional index mapping packed key to record offset (NULL if disabled)
+  st_table * index;
+  // Cached read-only IO::Buffer view of the status buffer (or nil) and the
+  // hidden object holding the view's reference to the attachment (or nil)
+  VALUE view;
+  VALUE view_owner;
+  // Lock statistics (only updated if lock_stats_enabled is non-zero)
+  int lock_stats_enabled;
+  struct {
+    unsigned long count;
+    double wait_total;
+    double wait_max;
+    double hold_total;
+    double hold_max;
+  } lock_stats;
+  // Time (per rb_hps_now) the lock was acquired or 0 if not known
+  double locked_at;
+  // Non-zero if s.buf is a malloc'd copy owned by this object (Snapshot)
+  int owns_buf;
+  // Time (CLOCK_REALTIME) at which the copy was made (Snapshot only)
+  struct timespec time;
+} rb_hps_t;
+
+// Returns the rb_hps_t containing the hashpipe_status_t pointed to by s.
+#define RB_HPS_OBJ(s) ((rb_hps_t *)(s))
+
+#define Data_Get_HPObj(self, p) \
+  Data_Get_Struct(self, rb_hps_t, p);
+
 #define Data_Get_HPStruct(self, s) \
-  Data_Get_Struct(self, hashpipe_status_t, s);
+  do { \
+    rb_hps_t * _hpp; \
+    Data_Get_HPObj(self, _hpp); \
+    s = &_hpp->s; \
+  } while(0);
 
 #define Data_Get_HPStruct_Ensure_Detached(self, s) \
   Data_Get_HPStruct(self, s); \
@@ -35,14 +111,161 @@
  * A +Status+ object encapsulates a Hashpipe status buffer.
  */
 
+/*
+ * Document-class: Hashpipe::Snapshot
+ *
+ * A +Snapshot+ object is an immutable copy of the contents of a Hashpipe
+ * status buffer as returned by Status#snapshot.
+ */
+
+static VALUE cStatus;
+static VALUE cSnapshot;
+
+// A process-wide attachment to the status buffer of one instance, shared by
+// all Status objects attached to that instance.  The status buffer is
+// detached when the last reference is released.  Only accessed with the GVL.
+struct rb_hps_attachment {
+  hashpipe_status_t s;
+  // Number of users
+  long refs;
+  // List of users: attached Status objects, Recorders, and the owners of
+  // views (see rb_hps_view)
+  rb_hps_t * users;
+  struct rb_hps_attachment * next;
+};
+
+// List of all attachments of this process
+static struct rb_hps_attachment * rb_hps_attachments = NULL;
+
+// Returns the attachment for instance_id, or NULL if there is none.
+static struct rb_hps_attachment *
+rb_hps_att_find(int instance_id)
+{
+  struct rb_hps_attachment * att;
+
+  for(att = rb_hps_attachments; att; att = att->next)
+    if(att->s.instance_id == instance_id)
+      break;
+
+  return att;
+}
+
+// Makes p a user of att, copying att's status buffer into p.
+static void
+rb_hps_att_add_user(struct rb_hps_attachment * att, rb_hps_t * p)
+{
+  p->s = att->s;
+  p->att = att;
+  p->att_prev = NULL;
+  p->att_next = att->users;
+  if(att->users)
+    att->users->att_prev = p;
+  att->users = p;
+  att->refs++;
+}
+
+// Removes p from the list of users of its attachment (without releasing its
+// reference).
+static void
+rb_hps_att_unlink_user(rb_hps_t * p)
+{
+  if(p->att_prev)
+    p->att_prev->att_next = p->att_next;
+  else
+    p->att->users = p->att_next;
+  if(p->att_next)
+    p->att_next->att_prev = p->att_prev;
+  p->att_prev = p->att_next = NULL;
+}
+
+// Releases the reference of p to its attachment, detaching from the status
+// buffer if it was the last one, and marks p as detached.  Returns the return
+// code of hashpipe_status_detach (or 0 if the status buffer is still in use).
+static int
+rb_hps_att_release(rb_hps_t * p)
+{
+  struct rb_hps_attachment * att = p->att;
+  struct rb_hps_attachment ** pp;
+  int rc = 0;
+
+  rb_hps_att_unlink_user(p);
+  p->att = NULL;
+  p->s.buf = 0;
+
+  if(--att->refs == 0) {
+    rc = hashpipe_status_detach(&att->s);
+    for(pp = &rb_hps_attachments; *pp != att; pp = &(*pp)->next)
+      ;
+    *pp = att->next;
+    xfree(att);
+  }
+
+  return rc;
+}
+
+// Clears the key index of p (if enabled) so that it gets rebuilt on next use.
+static void
+rb_hps_index_clear(rb_hps_t * p)
+{
+  if(p->index)
+    st_clear(p->index);
+}
+
+static void
+rb_hps_mark(void * p)
+{
+  rb_gc_mark(((rb_hps_t *)p)->view);
+  rb_gc_mark(((rb_hps_t *)p)->view_owner);
+}
+
+// A Status object that is garbage collected while attached releases its
+// attachment.  Its view, if any, holds a reference of its own.
+static void
+rb_hps_free(void * p)
+{
+  if(((rb_hps_t *)p)->att)
+    rb_hps_att_release((rb_hps_t *)p);
+  if(((rb_hps_t *)p)->index)
+    st_free_table(((rb_hps_t *)p)->index);
+  if(((rb_hps_t *)p)->owns_buf)
+    free(((rb_hps_t *)p)->s.buf);
+  xfree(p);
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+// Frees the owner of a view (see rb_hps_view), releasing its reference to the
+// attachment.
+static void
+rb_hps_view_owner_free(void * p)
+{
+  if(((rb_hps_t *)p)->att)
+    rb_hps_att_release((rb_hps_t *)p);
+  xfree(p);
+}
+
+// Releases the reference to the attachment of the view owner vowner (if
+// not already released).
+static void
+rb_hps_view_owner_release(VALUE vowner)
+{
+  rb_hps_t * p;
+
+  Data_Get_HPObj(vowner, p);
+  if(p->att)
+    rb_hps_att_release(p);
+}
+#endif
+
 static VALUE
 rb_hps_alloc(VALUE klass)
 {
-  hashpipe_status_t * p;
+  rb_hps_t * p;
   VALUE v;
   
-  v = Data_Make_Struct(klass, hashpipe_status_t, 0, free, p);
-  memset(p, 0, sizeof(hashpipe_status_t));
+  v = Data_Make_Struct(klass, rb_hps_t, rb_hps_mark, rb_hps_free, p);
+  memset(p, 0, sizeof(rb_hps_t));
+  p->view = Qnil;
+  p->view_owner = Qnil;
   return v;
 }
 
@@ -81,6 +304,11 @@ VALUE rb_hps_exists(VALUE klass, VALUE vid)
  * (Integer).  It is an error to call attach if already attached.  If +create+
  * is false, an exception will be raised if the specified statsu buffer does
  * not exist.
+ *
+ * Attachments are pooled per process: all Status objects attached to the same
+ * instance share one attachment, so only the first one pays the cost of
+ * attaching.  The status buffer is detached when the last of them is detached
+ * or garbage collected.
  */
 VALUE rb_hps_attach(int argc, VALUE *argv, VALUE self)
 {
@@ -88,6 +316,7 @@ VALUE rb_hps_attach(int argc, VALUE *argv, VALUE self)
   int id;
   VALUE vrc;
   hashpipe_status_t tmp, *s;
+  struct rb_hps_attachment * att;
 
   rb_scan_args(argc, argv, "11", &vid, &vcreate);
 
@@ -101,17 +330,32 @@ VALUE rb_hps_attach(int argc, VALUE *argv, VALUE self)
 
   Data_Get_HPStruct_Ensure_Detached(self, s);
 
-  // Ensure that instance_id field is set
-  tmp.instance_id = id;
-
-  vrc = (VALUE)rb_thread_blocking_region(
-      rb_hps_attach_blocking_func, &tmp,
-      RUBY_UBF_PROCESS, NULL);
-
-  if(RTEST(vrc))
-    rb_raise(rb_eRuntimeError, "could not attach to instance id %d", id);
+  att = rb_hps_att_find(id);
+  if(!att) {
+    // Ensure that instance_id field is set
+    tmp.instance_id = id;
+
+    vrc = (VALUE)rb_thread_blocking_region(
+        rb_hps_attach_blocking_func, &tmp,
+        RUBY_UBF_PROCESS, NULL);
+
+    if(RTEST(vrc))
+      rb_raise(rb_eRuntimeError, "could not attach to instance id %d", id);
+
+    // Another thread may have attached while the GVL was released
+    att = rb_hps_att_find(id);
+    if(att) {
+      hashpipe_status_detach(&tmp);
+    } else {
+      att = ZALLOC(struct rb_hps_attachment);
+      att->s = tmp;
+      att->next = rb_hps_attachments;
+      rb_hps_attachments = att;
+    }
+  }
 
-  memcpy(s, &tmp, sizeof(hashpipe_status_t));
+  rb_hps_att_add_user(att, RB_HPS_OBJ(s));
+  rb_hps_index_clear(RB_HPS_OBJ(s));
 
   return self;
 }
@@ -141,17 +385,90 @@ VALUE rb_hps_detach(VALUE self)
   Data_Get_HPStruct(self, s);
 
   if(s->buf) {
-    rc = hashpipe_status_detach(s);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+    // Invalidate view, if any, before the memory it refers to goes away
+    if(!NIL_P(RB_HPS_OBJ(s)->view)) {
+      rb_io_buffer_free(RB_HPS_OBJ(s)->view);
+      rb_hps_view_owner_release(RB_HPS_OBJ(s)->view_owner);
+      RB_HPS_OBJ(s)->view = Qnil;
+      RB_HPS_OBJ(s)->view_owner = Qnil;
+    }
+#endif
+
+    rc = rb_hps_att_release(RB_HPS_OBJ(s));
+    rb_hps_index_clear(RB_HPS_OBJ(s));
 
     if(rc != 0)
       rb_raise(rb_eRuntimeError, "could not detach");
-
-    s->buf = 0;
   }
 
   return self;
 }
 
+/*
+ * call-seq: Status.after_fork -> nil
+ *
+ * Reattaches all of the status buffers that this process is attached to.
+ * This should be called in a child process after forking (lib/hashpipe.rb
+ * arranges for this to happen automatically for Process.fork and
+ * Process.daemon).  The child's own attachments replace the ones inherited
+ * from the parent, which are then detached.  All attached Status objects are
+ * updated in place; their views (see #view) are invalidated and their key
+ * indexes are cleared.  Recorders inherited from the parent are marked as
+ * stopped, since their sampling threads exist only in the parent.  If
+ * reattaching to an instance fails, the inherited attachment is kept and an
+ * exception is raised after all instances have been tried.
+ */
+static void rb_hps_rec_after_fork(void);
+
+VALUE rb_hps_after_fork(VALUE klass)
+{
+  struct rb_hps_attachment * att;
+  hashpipe_status_t tmp, old;
+  rb_hps_t * p;
+  VALUE vrc;
+  int failed_id = -1;
+
+  rb_hps_rec_after_fork();
+
+  for(att = rb_hps_attachments; att; att = att->next) {
+    tmp.instance_id = att->s.instance_id;
+
+    vrc = (VALUE)rb_thread_blocking_region(
+        rb_hps_attach_blocking_func, &tmp,
+        RUBY_UBF_PROCESS, NULL);
+
+    if(RTEST(vrc)) {
+      if(failed_id < 0)
+        failed_id = att->s.instance_id;
+      continue;
+    }
+
+    old = att->s;
+    att->s = tmp;
+    for(p = att->users; p; p = p->att_next) {
+#ifdef HAVE_RUBY_IO_BUFFER_H
+      if(!NIL_P(p->view)) {
+        rb_io_buffer_free(p->view);
+        p->view = Qnil;
+        // The owner remains a user until it is garbage collected
+        p->view_owner = Qnil;
+      }
+#endif
+      p->s = att->s;
+      p->locked_at = 0;
+      rb_hps_index_clear(p);
+    }
+    hashpipe_status_detach(&old);
+  }
+
+  if(failed_id >= 0)
+    rb_raise(rb_eRuntimeError, "could not reattach to instance id %d",
+        failed_id);
+
+  return Qnil;
+}
+
 /*
  * call-seq: attached? -> +true+ or +false+
  *
@@ -180,6 +497,213 @@ VALUE rb_hps_instance_id(VALUE self)
   return s->buf ? INT2NUM(s->instance_id) : Qnil;
 }
 
+// Returns current CLOCK_MONOTONIC time in seconds.
+static double
+rb_hps_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the start time of a lock wait for p if lock statistics are enabled,
+// otherwise 0.  May be called without the GVL.
+static inline double
+rb_hps_lock_wait_begin(rb_hps_t * p)
+{
+  return p->lock_stats_enabled ? rb_hps_now() : 0;
+}
+
+// Records the acquisition of the lock of p after waiting since t0 (as
+// returned by rb_hps_lock_wait_begin).  May be called without the GVL since
+// it is only called while holding the lock.
+static void
+rb_hps_lock_acquired(rb_hps_t * p, double t0)
+{
+  double now, wait;
+
+  if(!p->lock_stats_enabled || t0 == 0) {
+    p->locked_at = 0;
+    return;
+  }
+
+  now = rb_hps_now();
+  wait = now - t0;
+  p->lock_stats.count++;
+  p->lock_stats.wait_total += wait;
+  if(wait > p->lock_stats.wait_max)
+    p->lock_stats.wait_max = wait;
+  p->locked_at = now;
+}
+
+// Records the release of the lock of p.  Must be called just before
+// unlocking.  May be called without the GVL.
+static void
+rb_hps_lock_releasing(rb_hps_t * p)
+{
+  double hold;
+
+  if(p->lock_stats_enabled && p->locked_at != 0) {
+    hold = rb_hps_now() - p->locked_at;
+    p->lock_stats.hold_total += hold;
+    if(hold > p->lock_stats.hold_max)
+      p->lock_stats.hold_max = hold;
+  }
+  p->locked_at = 0;
+}
+
+/*
+ * call-seq: lock_stats_enabled = true or false
+ *
+ * Enables or disables the collection of lock statistics for +self+.  See
+ * #lock_stats.
+ */
+VALUE rb_hps_set_lock_stats_enabled(VALUE self, VALUE venable)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+  p->lock_stats_enabled = RTEST(venable);
+
+  return venable;
+}
+
+/*
+ * call-seq: lock_stats_enabled? -> +true+ or +false+
+ *
+ * Returns true if lock statistics are being collected for +self+.
+ */
+VALUE rb_hps_lock_stats_enabled_p(VALUE self)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+
+  return p->lock_stats_enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: lock_stats -> Hash or nil
+ *
+ * Returns a Hash of lock statistics for +self+ or +nil+ if lock statistics
+ * are not enabled (see #lock_stats_enabled=).  The Hash contains the number
+ * of lock acquisitions (:count) and the total and maximum number of seconds
+ * spent waiting for the lock (:wait_total, :wait_max) and holding the lock
+ * (:hold_total, :hold_max).  Only locking done via +self+ (including the
+ * internal locking of methods such as #to_hash) is counted.  Statistics
+ * accumulate until #reset_lock_stats is called.
+ */
+VALUE rb_hps_lock_stats(VALUE self)
+{
+  VALUE h;
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+
+  if(!p->lock_stats_enabled)
+    return Qnil;
+
+  h = rb_hash_new();
+  rb_hash_aset(h, ID2SYM(rb_intern("count")), ULONG2NUM(p->lock_stats.count));
+  rb_hash_aset(h, ID2SYM(rb_intern("wait_total")),
+      DBL2NUM(p->lock_stats.wait_total));
+  rb_hash_aset(h, ID2SYM(rb_intern("wait_max")),
+      DBL2NUM(p->lock_stats.wait_max));
+  rb_hash_aset(h, ID2SYM(rb_intern("hold_total")),
+      DBL2NUM(p->lock_stats.hold_total));
+  rb_hash_aset(h, ID2SYM(rb_intern("hold_max")),
+      DBL2NUM(p->lock_stats.hold_max));
+
+  return h;
+}
+
+/*
+ * call-seq: reset_lock_stats -> self
+ *
+ * Resets all lock statistics of +self+ to zero.
+ */
+VALUE rb_hps_reset_lock_stats(VALUE self)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+  memset(&p->lock_stats, 0, sizeof(p->lock_stats));
+
+  return self;
+}
+
+// Return values of rb_hps_lock_nogvl
+#define RB_HPS_LOCK_OK        0
+#define RB_HPS_LOCK_TIMEDOUT  1
+#define RB_HPS_LOCK_ERROR    -1
+
+// Locks s, recording lock statistics, waiting until deadline (an absolute
+// CLOCK_REALTIME time) if deadline is not NULL or indefinitely otherwise.
+// Returns one of the RB_HPS_LOCK_* values.  May be called without the GVL.
+static int
+rb_hps_lock_nogvl(hashpipe_status_t * s, const struct timespec * deadline)
+{
+  int rc;
+  double t0 = rb_hps_lock_wait_begin(RB_HPS_OBJ(s));
+
+  if(deadline) {
+    while((rc = sem_timedwait(s->lock, deadline)) && errno == EINTR);
+    if(rc)
+      return errno == ETIMEDOUT ? RB_HPS_LOCK_TIMEDOUT : RB_HPS_LOCK_ERROR;
+  } else if(hashpipe_status_lock(s)) {
+    return RB_HPS_LOCK_ERROR;
+  }
+
+  rb_hps_lock_acquired(RB_HPS_OBJ(s), t0);
+  return RB_HPS_LOCK_OK;
+}
+
+// Unlocks s, recording lock statistics.  Returns the return value of
+// hashpipe_status_unlock.  May be called without the GVL.
+static int
+rb_hps_unlock_nogvl(hashpipe_status_t * s)
+{
+  rb_hps_lock_releasing(RB_HPS_OBJ(s));
+  return hashpipe_status_unlock(s);
+}
+
+// Sets *deadline to the CLOCK_REALTIME time timeout seconds from now.
+// Negative timeouts are treated as zero.
+static void
+rb_hps_deadline(double timeout, struct timespec * deadline)
+{
+  if(timeout < 0)
+    timeout = 0;
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += (time_t)timeout;
+  deadline->tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+  if(deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+// Parses the optional timeout keyword argument from opts (as returned by
+// rb_scan_args with ":").  Returns 1 and sets *deadline if a non-nil timeout
+// was given, otherwise returns 0.
+static int
+rb_hps_get_deadline(VALUE vopts, struct timespec * deadline)
+{
+  VALUE vtimeout = Qundef;
+  ID kw_timeout;
+
+  if(!NIL_P(vopts)) {
+    kw_timeout = rb_intern("timeout");
+    rb_get_kwargs(vopts, &kw_timeout, 0, 1, &vtimeout);
+  }
+
+  if(vtimeout == Qundef || NIL_P(vtimeout))
+    return 0;
+
+  rb_hps_deadline(NUM2DBL(vtimeout), deadline);
+  return 1;
+}
+
 /*
  * call-seq: unlock -> self
  *
@@ -193,7 +717,7 @@ VALUE rb_hps_unlock(VALUE self)
 
   Data_Get_HPStruct_Ensure_Attached(self, s);
 
-  rc = hashpipe_status_unlock(s);
+  rc = rb_hps_unlock_nogvl(s);
 
   if(rc != 0)
     rb_raise(rb_eRuntimeError, "unlock error");
@@ -207,36 +731,115 @@ static BLOCKING_TYPE
 rb_hps_lock_blocking_func(void * s)
 {
   int rc;
-  rc = hashpipe_status_lock((hashpipe_status_t *)s);
+  rc = rb_hps_lock_nogvl((hashpipe_status_t *)s, NULL);
   return (BLOCKING_TYPE)(rc ? Qtrue : Qfalse);
 }
 
+struct rb_hps_timedlock_args {
+  hashpipe_status_t * s;
+  struct timespec deadline;
+  int rc;
+};
+
+// This is called by rb_thread_blocking_region withOUT GVL.
+// Returns Qnil always (result is stored in rc).
+static BLOCKING_TYPE
+rb_hps_timedlock_blocking_func(void * vargs)
+{
+  struct rb_hps_timedlock_args * args = (struct rb_hps_timedlock_args *)vargs;
+  args->rc = rb_hps_lock_nogvl(args->s, &args->deadline);
+  return (BLOCKING_TYPE)Qnil;
+}
+
+// Called after the status buffer has been locked.  If block given, yield self
+// to the block, ensure unlock is called after block finishes, and return
+// block's return value.  Otherwise return self.
+static VALUE
+rb_hps_locked_yield(VALUE self)
+{
+  if(rb_block_given_p())
+    return rb_ensure(rb_yield, self, rb_hps_unlock, self);
+  else
+    return self;
+}
+
 /*
- * call-seq: lock -> self
+ * call-seq:
+ *   lock -> self
+ *   lock {|status| ...} -> obj
+ *   lock(timeout: seconds) -> self or nil
+ *   lock(timeout: seconds) {|status| ...} -> obj or nil
  *
  * Locks the status buffer for exclusive access.  You should always lock the
- * status buffer before reading or modifying it.
+ * status buffer before reading or modifying it.  If a block is given, +self+
+ * is yielded to the block, the status buffer is unlocked when the block
+ * finishes, and the block's value is returned.
+ *
+ * If +timeout+ is given, waits at most +timeout+ seconds for the lock and
+ * returns +nil+ (without calling the block) if it could not be acquired in
+ * that time.  Without +timeout+, waits indefinitely.
  */
-VALUE rb_hps_lock(VALUE self)
+VALUE rb_hps_lock(int argc, VALUE *argv, VALUE self)
 {
-  VALUE vrc;
+  VALUE vrc, vopts;
+  struct rb_hps_timedlock_args args;
   hashpipe_status_t *s;
 
+  rb_scan_args(argc, argv, "0:", &vopts);
+
   Data_Get_HPStruct_Ensure_Attached(self, s);
 
-  vrc = (VALUE)rb_thread_blocking_region(
-      rb_hps_lock_blocking_func, s,
-      RUBY_UBF_PROCESS, NULL);
+  if(!rb_hps_get_deadline(vopts, &args.deadline)) {
+    vrc = (VALUE)rb_thread_blocking_region(
+        rb_hps_lock_blocking_func, s,
+        RUBY_UBF_PROCESS, NULL);
+  } else {
+    args.s = s;
+    rb_thread_blocking_region(
+        rb_hps_timedlock_blocking_func, &args,
+        RUBY_UBF_PROCESS, NULL);
+
+    if(args.rc == RB_HPS_LOCK_TIMEDOUT)
+      return Qnil;
+    vrc = args.rc ? Qtrue : Qfalse;
+  }
 
   if(RTEST(vrc))
     rb_raise(rb_eRuntimeError, "lock error");
 
-  // If block given, yield self to the block, ensure unlock is called after
-  // block finishes, and return block's return value.
-  if(rb_block_given_p())
-    return rb_ensure(rb_yield, self, rb_hps_unlock, self);
-  else
-    return self;
+  return rb_hps_locked_yield(self);
+}
+
+/*
+ * call-seq:
+ *   try_lock -> self or nil
+ *   try_lock {|status| ...} -> obj or nil
+ *
+ * Locks the status buffer if it is not currently locked.  Returns +nil+
+ * immediately (without calling the block) if the status buffer is already
+ * locked.  Otherwise behaves like #lock.
+ */
+VALUE rb_hps_try_lock(VALUE self)
+{
+  int rc;
+  double t0;
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  t0 = rb_hps_lock_wait_begin(RB_HPS_OBJ(s));
+
+  while((rc = sem_trywait(s->lock)) && errno == EINTR);
+
+  if(rc) {
+    if(errno == EAGAIN)
+      return Qnil;
+    rb_raise(rb_eRuntimeError, "lock error");
+  }
+
+  rb_hps_lock_acquired(RB_HPS_OBJ(s), t0);
+
+  return rb_hps_locked_yield(self);
 }
 
 // This is called by rb_thread_blocking_region withOUT GVL.
@@ -277,154 +880,2637 @@ VALUE rb_hps_buf(VALUE self)
   return rb_str_new(s->buf, len);
 }
 
-VALUE rb_hps_length(VALUE self)
+/*
+ * call-seq: view -> IO::Buffer
+ *
+ * Returns a read-only IO::Buffer that refers directly to the status buffer's
+ * shared memory (i.e. without copying it).  The view spans the entire status
+ * buffer; its valid contents end with the END record (see #length).  The same
+ * view is returned until #detach is called, which invalidates it.  The view
+ * keeps the status buffer attached for as long as it is reachable, even if
+ * +self+ is garbage collected.  Because the status buffer can change at any
+ * time, the contents of the view are only meaningful while the status buffer
+ * is locked.  Requires Ruby 3.1 or newer.
+ */
+VALUE rb_hps_view(VALUE self)
 {
+#ifdef HAVE_RUBY_IO_BUFFER_H
   hashpipe_status_t *s;
+  rb_hps_t * op;
+  VALUE vowner;
+
   Data_Get_HPStruct_Ensure_Attached(self, s);
-  return UINT2NUM((unsigned int)gethlength(s->buf));
-}
 
-#define HGET(typecode, type, conv) \
-  VALUE rb_hps_hget##typecode(VALUE self, VALUE vkey) \
-  { \
-    int rc; \
-    type val; \
-    hashpipe_status_t *s; \
-    char save = '\0'; \
-    char * key = StringValueCStr(vkey); \
-    if(strlen(key) > 8) { \
-      rb_warning("key '%s' truncated to 8 characters", key); \
-      save = key[8]; \
-      key[8] = '\0'; \
-    } \
-    Data_Get_HPStruct_Ensure_Attached(self, s); \
-    rc = hget##typecode(s->buf, key, &val); \
-    if(save) key[8] = save; \
-    return rc ? conv(val) : Qnil; \
+  if(NIL_P(RB_HPS_OBJ(s)->view)) {
+    // IO::Buffer has no way to own external memory, so the view refers to a
+    // hidden object that holds its own reference to the attachment
+    vowner = Data_Make_Struct(0, rb_hps_t, NULL, rb_hps_view_owner_free, op);
+    memset(op, 0, sizeof(rb_hps_t));
+    op->view = Qnil;
+    op->view_owner = Qnil;
+    rb_hps_att_add_user(RB_HPS_OBJ(s)->att, op);
+
+    RB_HPS_OBJ(s)->view = rb_io_buffer_new(s->buf,
+        HASHPIPE_STATUS_TOTAL_SIZE,
+        RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+    rb_ivar_set(RB_HPS_OBJ(s)->view, rb_intern("hashpipe_owner"), vowner);
+    RB_HPS_OBJ(s)->view_owner = vowner;
   }
 
-HGET(i4, int, INT2NUM)
-HGET(u4, unsigned int, UINT2NUM)
-// Match conversion function to int8 type from fitshead.h
-#if __SIZEOF_INT__ == 8
-HGET(i8, int8, INT2NUM)
-HGET(u8, int8, UINT2NUM)
-#elif __SIZEOF_LONG__ == 8
-HGET(i8, int8, LONG2NUM)
-HGET(u8, int8, ULONG2NUM)
-#elif __SIZEOF_LONG_LONG__ == 8
-HGET(i8, int8, LL2NUM)
-HGET(u8, int8, ULL2NUM)
+  return RB_HPS_OBJ(s)->view;
 #else
-#error cannot determine 8 byte integer type
+  rb_notimplement();
+  return Qnil; // Not reached
 #endif
-HGET(r4, float, DBL2NUM)
-HGET(r8, double, DBL2NUM)
+}
 
-VALUE rb_hps_hgets(VALUE self, VALUE vkey)
+VALUE rb_hps_length(VALUE self)
 {
-  int rc;
-  char val[HASHPIPE_STATUS_RECORD_SIZE];
   hashpipe_status_t *s;
-  char save = '\0';
-  char * key = StringValueCStr(vkey);
-  if(strlen(key) > 8) {
-    rb_warning("key '%s' truncated to 8 characters", key);
-    save = key[8];
-    key[8] = '\0';
-  }
   Data_Get_HPStruct_Ensure_Attached(self, s);
-  rc = hgets(s->buf, key, HASHPIPE_STATUS_RECORD_SIZE, val);
-  val[HASHPIPE_STATUS_RECORD_SIZE-1] = '\0';
-  if(save) key[8] = save;
-  return rc ? rb_str_new_cstr(val) : Qnil;
+  return UINT2NUM((unsigned int)gethlength(s->buf));
 }
 
-VALUE rb_hps_delete(VALUE self, VALUE vkey)
+// Primes and helpers for rb_hps_checksum, which is XXH64 (seed 0).
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t
+xxh_read64(const char * p)
 {
-  hashpipe_status_t *s;
-  char save = '\0';
-  char * key;
-  VALUE val;
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
-  // Get current value (to be returned)
-  val = rb_hps_hgets(self, vkey);
-  // If found,
-  if(RTEST(val)) {
-    // Delete key
-    key = StringValueCStr(vkey);
-    if(strlen(key) > 8) {
-      // Already warned
-      save = key[8];
-      key[8] = '\0';
-    }
-    Data_Get_HPStruct_Ensure_Attached(self, s);
-    hdel(s->buf, key);
-    if(save) key[8] = save;
-  }
+static inline uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_P2;
+  acc = XXH_ROTL(acc, 31);
+  return acc * XXH_P1;
+}
 
-  return val;
+static inline uint64_t
+xxh_merge(uint64_t acc, uint64_t val)
+{
+  acc ^= xxh_round(0, val);
+  return acc * XXH_P1 + XXH_P4;
 }
 
-#define HPUT(typecode, type, conv) \
-  VALUE rb_hps_hput##typecode(VALUE self, VALUE vkey, VALUE vval) \
-  { \
-    hashpipe_status_t *s; \
-    char save = '\0'; \
-    char * key = StringValueCStr(vkey); \
-    type val; \
-    if(strlen(key) > 8) { \
-      rb_warning("key '%s' truncated to 8 characters", key); \
-      save = key[8]; \
-      key[8] = '\0'; \
-    } \
-    val = (type)conv(vval); \
-    Data_Get_HPStruct_Ensure_Attached(self, s); \
-    hput##typecode(s->buf, key, val); \
-    if(save) key[8] = save; \
-    return self; \
+// Returns a 64 bit fingerprint of the len bytes at buf.  This is XXH64, which
+// processes 32 bytes per iteration in four independent lanes so it runs at
+// memory speed on typical status buffer sizes.
+static uint64_t
+rb_hps_checksum(const char * buf, size_t len)
+{
+  const char * p = buf;
+  const char * end = buf + len;
+  uint64_t h, v1, v2, v3, v4;
+
+  if(len >= 32) {
+    v1 = XXH_P1 + XXH_P2;
+    v2 = XXH_P2;
+    v3 = 0;
+    v4 = -XXH_P1;
+    do {
+      v1 = xxh_round(v1, xxh_read64(p));
+      v2 = xxh_round(v2, xxh_read64(p+8));
+      v3 = xxh_round(v3, xxh_read64(p+16));
+      v4 = xxh_round(v4, xxh_read64(p+24));
+      p += 32;
+    } while(p + 32 <= end);
+    h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = XXH_P5;
   }
 
-HPUT(i4, int, NUM2INT)
-HPUT(u4, unsigned int, NUM2UINT)
-// Match conversion function to int8 type from fitshead.h
-#if __SIZEOF_INT__ == 8
-HPUT(i8, int8, NUM2INT)
-HPUT(u8, uint8, NUM2UINT)
-#elif __SIZEOF_LONG__ == 8
-HPUT(i8, int8, NUM2LONG)
-HPUT(u8, uint8, NUM2ULONG)
-#elif __SIZEOF_LONG_LONG__ == 8
-HPUT(i8, int8, NUM2LL)
-HPUT(u8, uint8, NUM2ULL)
-#else
-#error cannot determine 8 byte integer type
-#endif
-HPUT(r4, float, NUM2DBL)
-HPUT(r8, double, NUM2DBL)
+  h += (uint64_t)len;
 
-VALUE rb_hps_hputs(VALUE self, VALUE vkey, VALUE vval)
-{
+  for(; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if(p + 4 <= end) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    h ^= (uint64_t)w * XXH_P1;
+    h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for(; p < end; p++) {
+    h ^= (uint64_t)(unsigned char)*p * XXH_P5;
+    h = XXH_ROTL(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/*
+ * call-seq: checksum -> Integer
+ *
+ * Returns a 64 bit fingerprint (currently XXH64) of the current contents of
+ * the status buffer (up to and including the END record).  The fingerprint
+ * changes whenever the contents change, so it can be saved and later passed
+ * to #changed_since? to cheaply skip work when nothing has changed.  This
+ * does not lock the status buffer; lock it first for a fingerprint of a
+ * consistent state.
+ */
+VALUE rb_hps_checksum_m(VALUE self)
+{
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+  return ULL2NUM(rb_hps_checksum(s->buf, gethlength(s->buf)));
+}
+
+/*
+ * call-seq: changed_since?(token) -> +true+ or +false+
+ *
+ * Returns true if the contents of the status buffer have changed since
+ * +token+ was obtained from #checksum.  Always returns true if +token+ is
+ * +nil+.
+ */
+VALUE rb_hps_changed_since_p(VALUE self, VALUE vtoken)
+{
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  if(NIL_P(vtoken))
+    return Qtrue;
+
+  return NUM2ULL(vtoken) != rb_hps_checksum(s->buf, gethlength(s->buf))
+    ? Qtrue : Qfalse;
+}
+
+// Minimum and maximum intervals (in nanoseconds) between polls of the
+// checksums by wait_for_change.  The interval starts at the minimum and
+// doubles after each poll that finds no change, so recent activity is noticed
+// quickly and idle status buffers cost very little to watch.
+#define RB_HPS_WAIT_MIN_NS   1000000L
+#define RB_HPS_WAIT_MAX_NS  50000000L
+
+// Return values of rb_hps_wait_blocking_func
+#define RB_HPS_WAIT_CHANGED      0
+#define RB_HPS_WAIT_TIMEDOUT     1
+#define RB_HPS_WAIT_INTERRUPTED  2
+#define RB_HPS_WAIT_ERROR       -1
+
+// A status buffer being watched and its checksum as of the last poll.
+struct rb_hps_watch {
+  hashpipe_status_t * s;
+  uint64_t checksum;
+};
+
+struct rb_hps_wait_args {
+  struct rb_hps_watch * watch;
+  long count;
+  struct timespec deadline;
+  int use_deadline;
+  volatile int interrupted;  // Set by rb_hps_wait_ubf
+  int rc;                    // One of the RB_HPS_WAIT_* values
+};
+
+// Returns the difference a - b in nanoseconds.
+static long long
+rb_hps_timespec_diff_ns(const struct timespec * a, const struct timespec * b)
+{
+  return (long long)(a->tv_sec - b->tv_sec) * 1000000000LL
+       + (a->tv_nsec - b->tv_nsec);
+}
+
+// This is called by rb_thread_blocking_region withOUT GVL.
+// Polls the checksums of the watched status buffers without locking them
+// until one differs or the deadline passes.  A change seen without the lock
+// is confirmed under the lock (so a torn read of a buffer being updated is
+// not reported as a change) and the confirmed checksum is stored in the watch
+// entry.  Returns Qnil always (result is stored in args).
+static BLOCKING_TYPE
+rb_hps_wait_blocking_func(void * vargs)
+{
+  struct rb_hps_wait_args * args = (struct rb_hps_wait_args *)vargs;
+  struct rb_hps_watch * w;
+  struct timespec now, ts;
+  long long left;
+  long interval = RB_HPS_WAIT_MIN_NS;
+  uint64_t sum;
+  long i;
+  int rc;
+
+  while(!args->interrupted) {
+    for(i = 0; i < args->count; i++) {
+      w = &args->watch[i];
+      if(rb_hps_checksum(w->s->buf, gethlength(w->s->buf)) == w->checksum)
+        continue;
+      rc = rb_hps_lock_nogvl(w->s, args->use_deadline ? &args->deadline : NULL);
+      if(rc != RB_HPS_LOCK_OK) {
+        args->rc = rc == RB_HPS_LOCK_TIMEDOUT
+          ? RB_HPS_WAIT_TIMEDOUT : RB_HPS_WAIT_ERROR;
+        return (BLOCKING_TYPE)Qnil;
+      }
+      sum = rb_hps_checksum(w->s->buf, gethlength(w->s->buf));
+      rb_hps_unlock_nogvl(w->s);
+      if(sum != w->checksum) {
+        w->checksum = sum;
+        args->rc = RB_HPS_WAIT_CHANGED;
+        return (BLOCKING_TYPE)Qnil;
+      }
+    }
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = interval;
+    if(args->use_deadline) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      left = rb_hps_timespec_diff_ns(&args->deadline, &now);
+      if(left <= 0) {
+        args->rc = RB_HPS_WAIT_TIMEDOUT;
+        return (BLOCKING_TYPE)Qnil;
+      }
+      if(left < interval)
+        ts.tv_nsec = (long)left;
+    }
+    nanosleep(&ts, NULL);
+
+    interval *= 2;
+    if(interval > RB_HPS_WAIT_MAX_NS)
+      interval = RB_HPS_WAIT_MAX_NS;
+  }
+
+  args->rc = RB_HPS_WAIT_INTERRUPTED;
+  return (BLOCKING_TYPE)Qnil;
+}
+
+// Unblocking function for rb_hps_wait_blocking_func.  The flag is checked at
+// least every RB_HPS_WAIT_MAX_NS nanoseconds.
+static void
+rb_hps_wait_ubf(void * vargs)
+{
+  ((struct rb_hps_wait_args *)vargs)->interrupted = 1;
+}
+
+// Waits for any of the count status buffers in watch to change from their
+// checksums in watch, until timeout seconds from now (forever if vtimeout is
+// nil), handling Ruby interrupts while waiting.  Returns non-zero if one
+// changed and zero on timeout.  Raises RuntimeError on lock error.
+static int
+rb_hps_wait_for_change(struct rb_hps_watch * watch, long count,
+    VALUE vtimeout)
+{
+  struct rb_hps_wait_args args;
+
+  args.watch = watch;
+  args.count = count;
+  args.use_deadline = !NIL_P(vtimeout);
+  if(args.use_deadline)
+    rb_hps_deadline(NUM2DBL(vtimeout), &args.deadline);
+
+  do {
+    args.interrupted = 0;
+    rb_thread_blocking_region(
+        rb_hps_wait_blocking_func, &args,
+        rb_hps_wait_ubf, &args);
+    if(args.rc == RB_HPS_WAIT_INTERRUPTED)
+      // Raises if the interrupt was an exception (e.g. Thread#raise)
+      rb_thread_check_ints();
+  } while(args.rc == RB_HPS_WAIT_INTERRUPTED);
+
+  if(args.rc == RB_HPS_WAIT_ERROR)
+    rb_raise(rb_eRuntimeError, "lock error");
+
+  return args.rc == RB_HPS_WAIT_CHANGED;
+}
+
+/*
+ * call-seq: wait_for_change(timeout=nil, token=nil) -> Integer or nil
+ *
+ * Waits (without the GVL) until the contents of the status buffer differ from
+ * those fingerprinted by +token+ (as returned by #checksum or a previous call
+ * to #wait_for_change) and returns the checksum of the new contents.  If
+ * +token+ is +nil+, waits for the contents to change from those at the time
+ * of the call.  Returns +nil+ if no change occurs within +timeout+ seconds
+ * (waits forever if +timeout+ is +nil+).
+ *
+ * The status buffer is polled without locking it, initially every millisecond
+ * and backing off to every 50 milliseconds while nothing changes.  It is only
+ * locked to confirm a change.  This call locks the status buffer internally
+ * so #lock must not be called prior to calling #wait_for_change.
+ */
+VALUE rb_hps_wait_for_change_m(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vtimeout, vtoken;
+  struct rb_hps_watch watch;
+  hashpipe_status_t *s;
+
+  rb_scan_args(argc, argv, "02", &vtimeout, &vtoken);
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+  watch.s = s;
+  watch.checksum = NIL_P(vtoken)
+    ? rb_hps_checksum(s->buf, gethlength(s->buf))
+    : NUM2ULL(vtoken);
+
+  if(!rb_hps_wait_for_change(&watch, 1, vtimeout))
+    return Qnil;
+
+  return ULL2NUM(watch.checksum);
+}
+
+// Returns true if c is a character that Ruby's String#strip would remove.
+#define IS_STRIP_CHAR(c) \
+  ((c) == ' ' || ((c) >= '\t' && (c) <= '\r') || (c) == '\0')
+
+// Returns a frozen String for use as a Hash key.
+#ifdef HAVE_RB_INTERNED_STR
+#define RB_HPS_KEY_STR(ptr, len) rb_interned_str(ptr, len)
+#else
+#define RB_HPS_KEY_STR(ptr, len) rb_obj_freeze(rb_str_new(ptr, len))
+#endif
+
+// Parses the HASHPIPE_STATUS_RECORD_SIZE character record rec into key and
+// value, returned as [*k0, *k1) and [*v0, *v1).  Keys and values are stripped
+// of surrounding whitespace and single quotes are removed from (and then
+// whitespace stripped from) quoted values.
+static void
+rb_hps_parse_record(const char * rec,
+    const char ** k0, const char ** k1, const char ** v0, const char ** v1)
+{
+  const char * end = rec + HASHPIPE_STATUS_RECORD_SIZE;
+
+  // Split on first '='
+  *k0 = rec;
+  *k1 = memchr(rec, '=', HASHPIPE_STATUS_RECORD_SIZE);
+  if(*k1) {
+    *v0 = *k1 + 1;
+    *v1 = end;
+  } else {
+    *k1 = end;
+    *v0 = *v1 = end;
+  }
+
+  // Strip key and value
+  while(*k0 < *k1 && IS_STRIP_CHAR(**k0)) (*k0)++;
+  while(*k1 > *k0 && IS_STRIP_CHAR((*k1)[-1])) (*k1)--;
+  while(*v0 < *v1 && IS_STRIP_CHAR(**v0)) (*v0)++;
+  while(*v1 > *v0 && IS_STRIP_CHAR((*v1)[-1])) (*v1)--;
+
+  // If value is enclosed in single quotes, remove them and strip spaces
+  if(*v1 - *v0 >= 2 && **v0 == '\'' && (*v1)[-1] == '\'') {
+    (*v0)++;
+    (*v1)--;
+    while(*v0 < *v1 && IS_STRIP_CHAR(**v0)) (*v0)++;
+    while(*v1 > *v0 && IS_STRIP_CHAR((*v1)[-1])) (*v1)--;
+  }
+}
+
+// Parses the HASHPIPE_STATUS_RECORD_SIZE character records of the first len
+// bytes of buf into a new Hash.  Parsing stops at the END record.
+static VALUE
+rb_hps_records_to_hash(const char * buf, int len)
+{
+  const char * rec;
+  const char * k0, * k1, * v0, * v1;
+  VALUE h = rb_hash_new();
+
+  for(rec = buf; rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + len;
+      rec += HASHPIPE_STATUS_RECORD_SIZE) {
+    // Stop at END record
+    if(!strncmp(rec, "END ", 4))
+      break;
+
+    rb_hps_parse_record(rec, &k0, &k1, &v0, &v1);
+    rb_hash_aset(h, RB_HPS_KEY_STR(k0, k1-k0), rb_str_new(v0, v1-v0));
+  }
+
+  return h;
+}
+
+// Locks the status buffer of self, then calls func(arg) and returns its
+// return value, ensuring that the status buffer is unlocked afterwards.  The
+// lock is acquired without the GVL.
+static VALUE
+rb_hps_with_lock(VALUE self, VALUE (*func)(VALUE), VALUE arg)
+{
+  VALUE vrc;
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  vrc = (VALUE)rb_thread_blocking_region(
+      rb_hps_lock_blocking_func, s,
+      RUBY_UBF_PROCESS, NULL);
+
+  if(RTEST(vrc))
+    rb_raise(rb_eRuntimeError, "lock error");
+
+  return rb_ensure(func, arg, rb_hps_unlock, self);
+}
+
+// Called via rb_hps_with_lock while status buffer is locked.
+static VALUE
+rb_hps_to_hash_locked(VALUE self)
+{
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+  return rb_hps_records_to_hash(s->buf, gethlength(s->buf));
+}
+
+/*
+ * call-seq: to_hash -> Hash
+ *
+ * Returns current buffer contents as a Hash.  Keys are frozen Strings.  This
+ * call locks the status buffer internally so #lock must not be called prior
+ * to calling #to_hash.
+ */
+VALUE rb_hps_to_hash(VALUE self)
+{
+  return rb_hps_with_lock(self, rb_hps_to_hash_locked, self);
+}
+
+// Type codes for typed access to status buffer values.  These correspond to
+// the suffixes of the hget/hput methods.
+enum rb_hps_type {
+  RB_HPS_TYPE_I4,
+  RB_HPS_TYPE_I8,
+  RB_HPS_TYPE_U4,
+  RB_HPS_TYPE_U8,
+  RB_HPS_TYPE_R4,
+  RB_HPS_TYPE_R8,
+  RB_HPS_TYPE_S
+};
+
+// Returns the rb_hps_type corresponding to vtype, which must be a Symbol or
+// String type code (e.g. :i4, "r8", :s).
+static enum rb_hps_type
+rb_hps_type_code(VALUE vtype)
+{
+  const char * type;
+
+  if(SYMBOL_P(vtype))
+    vtype = rb_sym2str(vtype);
+  type = StringValueCStr(vtype);
+
+  if(!strcmp(type, "i4")) return RB_HPS_TYPE_I4;
+  if(!strcmp(type, "i8")) return RB_HPS_TYPE_I8;
+  if(!strcmp(type, "u4")) return RB_HPS_TYPE_U4;
+  if(!strcmp(type, "u8")) return RB_HPS_TYPE_U8;
+  if(!strcmp(type, "r4")) return RB_HPS_TYPE_R4;
+  if(!strcmp(type, "r8")) return RB_HPS_TYPE_R8;
+  if(!strcmp(type, "s"))  return RB_HPS_TYPE_S;
+
+  rb_raise(rb_eArgError, "invalid type code '%s'", type);
+  return RB_HPS_TYPE_S; // Not reached
+}
+
+// Packs the first 8 characters of a record (or a key), padded with spaces,
+// into a 64 bit integer suitable for comparing or hashing keys as a single
+// word.  The characters are packed verbatim because fitshead (and so the hget
+// and hput methods) match keys case sensitively.
+static uint64_t
+rb_hps_pack_key(const char * key, size_t len)
+{
+  char padded[8];
+  size_t i;
+  uint64_t packed;
+
+  if(len > 8)
+    len = 8;
+  for(i = 0; i < 8; i++)
+    padded[i] = i < len ? key[i] : ' ';
+  memcpy(&packed, padded, sizeof(packed));
+
+  return packed;
+}
+
+// A status buffer key: up to 8 characters (NUL terminated), its length, and
+// its packed form (see rb_hps_pack_key).
+typedef struct {
+  char key[9];
+  size_t len;
+  uint64_t packed;
+} rb_hps_key_t;
+
+/*
+ * Document-class: Hashpipe::Key
+ *
+ * A +Key+ object holds a status buffer key that has been validated, padded,
+ * and packed once so that it can be passed to the hget/hput methods of Status
+ * and Snapshot in tight loops with no per-call key processing.
+ */
+
+static VALUE cKey;
+
+// Fills k from the len characters at key, truncating to 8 characters.
+static void
+rb_hps_key_init(rb_hps_key_t * k, const char * key, size_t len)
+{
+  if(len > 8)
+    len = 8;
+  memcpy(k->key, key, len);
+  k->key[len] = '\0';
+  k->len = len;
+  k->packed = rb_hps_pack_key(key, len);
+}
+
+// Returns the rb_hps_key_t for vkey, which may be a Key, a Symbol, or a
+// String.  For Key objects, a pointer to the Key's own (already validated and
+// packed) rb_hps_key_t is returned.  Otherwise *tmp is filled in from the
+// (possibly truncated with a warning) characters of vkey and tmp is returned.
+// vkey itself is never modified.
+static const rb_hps_key_t *
+rb_hps_get_key(VALUE vkey, rb_hps_key_t * tmp)
+{
+  const rb_hps_key_t * k;
+
+  if(rb_obj_class(vkey) == cKey) {
+    Data_Get_Struct(vkey, rb_hps_key_t, k);
+    return k;
+  }
+
+  if(SYMBOL_P(vkey))
+    vkey = rb_sym2str(vkey);
+  else
+    StringValue(vkey);
+
+  // Like StringValueCStr, reject keys with embedded NULs
+  if(memchr(RSTRING_PTR(vkey), '\0', RSTRING_LEN(vkey)))
+    rb_raise(rb_eArgError, "string contains null byte");
+
+  if(RSTRING_LEN(vkey) > 8)
+    rb_warning("key '%.*s' truncated to 8 characters",
+        (int)RSTRING_LEN(vkey), RSTRING_PTR(vkey));
+
+  rb_hps_key_init(tmp, RSTRING_PTR(vkey), RSTRING_LEN(vkey));
+  return tmp;
+}
+
+static VALUE
+rb_hps_key_alloc(VALUE klass)
+{
+  rb_hps_key_t * k;
+  VALUE v;
+
+  v = Data_Make_Struct(klass, rb_hps_key_t, 0, RUBY_DEFAULT_FREE, k);
+  memset(k, 0, sizeof(rb_hps_key_t));
+  return v;
+}
+
+/*
+ * call-seq: Key.new(name) -> Key
+ *
+ * Creates a frozen Key for +name+ (a String or Symbol).  Raises ArgumentError
+ * if +name+ is empty, longer than 8 characters, or contains '=', spaces, or
+ * NUL characters.
+ */
+VALUE rb_hps_key_init_m(VALUE self, VALUE vname)
+{
+  rb_hps_key_t * k;
+  const char * name;
+  long i, len;
+
+  if(SYMBOL_P(vname))
+    vname = rb_sym2str(vname);
+  StringValue(vname);
+  name = RSTRING_PTR(vname);
+  len = RSTRING_LEN(vname);
+
+  if(len == 0 || len > 8)
+    rb_raise(rb_eArgError, "key must be 1 to 8 characters long");
+  for(i = 0; i < len; i++)
+    if(name[i] == '=' || name[i] == ' ' || name[i] == '\0')
+      rb_raise(rb_eArgError, "invalid character in key");
+
+  Data_Get_Struct(self, rb_hps_key_t, k);
+  rb_hps_key_init(k, name, len);
+
+  return rb_obj_freeze(self);
+}
+
+/*
+ * call-seq: to_s -> String
+ *
+ * Returns the key as a String.
+ */
+VALUE rb_hps_key_to_s(VALUE self)
+{
+  rb_hps_key_t * k;
+
+  Data_Get_Struct(self, rb_hps_key_t, k);
+  return rb_str_new(k->key, k->len);
+}
+
+/*
+ * call-seq: key == other -> +true+ or +false+
+ *
+ * Returns true if +other+ is a Key for the same key.
+ */
+VALUE rb_hps_key_eq(VALUE self, VALUE other)
+{
+  rb_hps_key_t * k, * o;
+
+  if(rb_obj_class(other) != cKey)
+    return Qfalse;
+
+  Data_Get_Struct(self, rb_hps_key_t, k);
+  Data_Get_Struct(other, rb_hps_key_t, o);
+
+  return k->len == o->len && !memcmp(k->key, o->key, k->len) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: hash -> Integer
+ *
+ * Returns a hash value for the key (so Keys can be used as Hash keys).
+ */
+VALUE rb_hps_key_hash(VALUE self)
+{
+  rb_hps_key_t * k;
+
+  Data_Get_Struct(self, rb_hps_key_t, k);
+  return ST2FIX(rb_memhash(k->key, k->len));
+}
+
+// Returns the value of the single record rec, whose key is key, as a double,
+// or NaN if the value is not numeric.  As with rb_hps_record_value, the record
+// is parsed on its own (followed by an END record) by fitshead.  Does not use
+// any Ruby API, so it may be called without the GVL.
+static double
+rb_hps_record_r8(const char * rec, const char * key)
+{
+  char hdr[2*HASHPIPE_STATUS_RECORD_SIZE+1];
+  double d;
+
+  memcpy(hdr, rec, HASHPIPE_STATUS_RECORD_SIZE);
+  memset(hdr+HASHPIPE_STATUS_RECORD_SIZE, ' ', HASHPIPE_STATUS_RECORD_SIZE);
+  memcpy(hdr+HASHPIPE_STATUS_RECORD_SIZE, "END", 3);
+  hdr[2*HASHPIPE_STATUS_RECORD_SIZE] = '\0';
+
+  return hgetr8(hdr, (char *)key, &d) ? d : NAN;
+}
+
+// Converts the value of the single record rec, whose key is key, to a Ruby
+// object according to type.  The record is copied into a two record header
+// (the record followed by an END record) so that the fitshead hget functions
+// can be used for the conversion without scanning the whole status buffer.
+static VALUE
+rb_hps_record_value(const char * rec, const char * key, enum rb_hps_type type)
+{
+  char hdr[2*HASHPIPE_STATUS_RECORD_SIZE+1];
+  char sval[HASHPIPE_STATUS_RECORD_SIZE];
+  int i4;
+  unsigned int u4;
+  int8 i8;
+  float r4;
+  double r8;
+  VALUE v = Qnil;
+
+  memcpy(hdr, rec, HASHPIPE_STATUS_RECORD_SIZE);
+  memset(hdr+HASHPIPE_STATUS_RECORD_SIZE, ' ', HASHPIPE_STATUS_RECORD_SIZE);
+  memcpy(hdr+HASHPIPE_STATUS_RECORD_SIZE, "END", 3);
+  hdr[2*HASHPIPE_STATUS_RECORD_SIZE] = '\0';
+
+  switch(type) {
+    case RB_HPS_TYPE_I4:
+      if(hgeti4(hdr, key, &i4)) v = INT2NUM(i4);
+      break;
+    case RB_HPS_TYPE_I8:
+      if(hgeti8(hdr, key, &i8)) v = INT82NUM(i8);
+      break;
+    case RB_HPS_TYPE_U4:
+      if(hgetu4(hdr, key, &u4)) v = UINT2NUM(u4);
+      break;
+    case RB_HPS_TYPE_U8:
+      if(hgetu8(hdr, key, &i8)) v = UINT82NUM(i8);
+      break;
+    case RB_HPS_TYPE_R4:
+      if(hgetr4(hdr, key, &r4)) v = DBL2NUM(r4);
+      break;
+    case RB_HPS_TYPE_R8:
+      if(hgetr8(hdr, key, &r8)) v = DBL2NUM(r8);
+      break;
+    case RB_HPS_TYPE_S:
+      if(hgets(hdr, key, HASHPIPE_STATUS_RECORD_SIZE, sval)) {
+        sval[HASHPIPE_STATUS_RECORD_SIZE-1] = '\0';
+        v = rb_str_new_cstr(sval);
+      }
+      break;
+  }
+
+  return v;
+}
+
+// Rebuilds the key index of p by walking all records up to the END record.
+// As with fitshead, the first record with a given key wins.
+static void
+rb_hps_index_rebuild(rb_hps_t * p)
+{
+  const char * buf = p->s.buf;
+  const char * rec;
+  st_data_t packed;
+
+  st_clear(p->index);
+  for(rec = buf; *rec && strncmp(rec, "END ", 4) &&
+      rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + HASHPIPE_STATUS_TOTAL_SIZE;
+      rec += HASHPIPE_STATUS_RECORD_SIZE) {
+    packed = (st_data_t)rb_hps_pack_key(rec, 8);
+    if(!st_lookup(p->index, packed, NULL))
+      st_insert(p->index, packed, (st_data_t)(rec - buf));
+  }
+}
+
+// Returns a pointer to the record for key using the key index of p (which
+// must be enabled), or NULL if key is not found.  The cached offset is used if
+// the record there still has the requested key, otherwise the index is rebuilt
+// and consulted again.
+static const char *
+rb_hps_index_lookup(rb_hps_t * p, const rb_hps_key_t * k)
+{
+  st_data_t packed = (st_data_t)k->packed;
+  st_data_t off;
+  int rebuilt = 0;
+
+  do {
+    if(st_lookup(p->index, packed, &off) &&
+        off + HASHPIPE_STATUS_RECORD_SIZE <= HASHPIPE_STATUS_TOTAL_SIZE &&
+        rb_hps_pack_key(p->s.buf + off, 8) == packed)
+      return p->s.buf + off;
+
+    if(rebuilt)
+      break;
+    rb_hps_index_rebuild(p);
+    rebuilt = 1;
+  } while(1);
+
+  return NULL;
+}
+
+// Returns the value of key converted according to type, or nil if key is not
+// found, using the key index of p (which must be enabled).
+static VALUE
+rb_hps_index_hget(rb_hps_t * p, const rb_hps_key_t * k, enum rb_hps_type type)
+{
+  const char * rec = rb_hps_index_lookup(p, k);
+  return rec ? rb_hps_record_value(rec, k->key, type) : Qnil;
+}
+
+/*
+ * call-seq: key_index = true or false
+ *
+ * Enables or disables the key index of +self+.  When enabled, the hget
+ * methods (including #hget_many) look up keys via a per-object index that
+ * maps keys to record offsets in the status buffer rather than scanning the
+ * buffer from the beginning on every call.  Before use, each cached offset is
+ * checked to still hold the requested key and the index is rebuilt (with one
+ * scan of the buffer) if it does not.  Lookups of keys that are not present
+ * always rebuild the index, so the index is best suited to repeated reads of
+ * keys that exist.
+ */
+VALUE rb_hps_set_key_index(VALUE self, VALUE venable)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+
+  if(RTEST(venable) && !p->index) {
+    p->index = st_init_numtable();
+  } else if(!RTEST(venable) && p->index) {
+    st_free_table(p->index);
+    p->index = NULL;
+  }
+
+  return venable;
+}
+
+/*
+ * call-seq: key_index? -> +true+ or +false+
+ *
+ * Returns true if the key index of +self+ is enabled.
+ */
+VALUE rb_hps_key_index_p(VALUE self)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+
+  return p->index ? Qtrue : Qfalse;
+}
+
+#define HGET(typecode, type, conv, hpstype) \
+  VALUE rb_hps_hget##typecode(VALUE self, VALUE vkey) \
+  { \
+    int rc; \
+    type val; \
+    hashpipe_status_t *s; \
+    rb_hps_key_t tmp; \
+    const rb_hps_key_t * k = rb_hps_get_key(vkey, &tmp); \
+    Data_Get_HPStruct_Ensure_Attached(self, s); \
+    if(RB_HPS_OBJ(s)->index) \
+      return rb_hps_index_hget(RB_HPS_OBJ(s), k, hpstype); \
+    rc = hget##typecode(s->buf, k->key, &val); \
+    RB_GC_GUARD(vkey); \
+    return rc ? conv(val) : Qnil; \
+  }
+
+HGET(i4, int, INT2NUM, RB_HPS_TYPE_I4)
+HGET(u4, unsigned int, UINT2NUM, RB_HPS_TYPE_U4)
+HGET(i8, int8, INT82NUM, RB_HPS_TYPE_I8)
+HGET(u8, int8, UINT82NUM, RB_HPS_TYPE_U8)
+HGET(r4, float, DBL2NUM, RB_HPS_TYPE_R4)
+HGET(r8, double, DBL2NUM, RB_HPS_TYPE_R8)
+
+VALUE rb_hps_hgets(VALUE self, VALUE vkey)
+{
   int rc;
+  char val[HASHPIPE_STATUS_RECORD_SIZE];
   hashpipe_status_t *s;
-  char save = '\0';
+  rb_hps_key_t tmp;
+  const rb_hps_key_t * k = rb_hps_get_key(vkey, &tmp);
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+  if(RB_HPS_OBJ(s)->index)
+    return rb_hps_index_hget(RB_HPS_OBJ(s), k, RB_HPS_TYPE_S);
+  rc = hgets(s->buf, k->key, HASHPIPE_STATUS_RECORD_SIZE, val);
+  val[HASHPIPE_STATUS_RECORD_SIZE-1] = '\0';
+  RB_GC_GUARD(vkey);
+  return rc ? rb_str_new_cstr(val) : Qnil;
+}
+
+// A single key lookup request of hget_many.
+struct rb_hps_key_req {
+  rb_hps_key_t k;
+  enum rb_hps_type type;
+};
+
+// Scans the records of buf once, resolving the offsets of the nreq requested
+// keys in reqs.  Returns a table (to be freed by the caller) mapping each
+// packed key to its record offset plus one, or 0 if the key is not found.  As
+// with the hget methods, the first matching record wins.
+static st_table *
+rb_hps_find_records(const char * buf, const struct rb_hps_key_req * reqs,
+    long nreq)
+{
+  st_table * offsets;
+  st_data_t off;
+  long i, nmissing = 0;
+  const char * rec;
+
+  // Map packed key to (record offset + 1), with 0 meaning not yet found
+  offsets = st_init_numtable_with_size(nreq);
+  for(i = 0; i < nreq; i++) {
+    off = (st_data_t)reqs[i].k.packed;
+    if(!st_lookup(offsets, off, NULL)) {
+      st_insert(offsets, off, 0);
+      nmissing++;
+    }
+  }
+
+  // Walk records until all keys are found or the END record is reached
+  for(rec = buf; nmissing > 0 && *rec && strncmp(rec, "END ", 4) &&
+      rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + HASHPIPE_STATUS_TOTAL_SIZE;
+      rec += HASHPIPE_STATUS_RECORD_SIZE) {
+    st_data_t packed = (st_data_t)rb_hps_pack_key(rec, 8);
+    if(st_lookup(offsets, packed, &off) && off == 0) {
+      st_insert(offsets, packed, (st_data_t)(rec - buf + 1));
+      nmissing--;
+    }
+  }
+
+  return offsets;
+}
+
+// Scans the records of buf once (see rb_hps_find_records), then converts and
+// returns the values of the nreq requested keys in reqs as an Array in the
+// same order as reqs.  The value of a missing key is nil.
+static VALUE
+rb_hps_hget_reqs(const char * buf, struct rb_hps_key_req * reqs, long nreq)
+{
+  st_table * offsets = rb_hps_find_records(buf, reqs, nreq);
+  st_data_t off;
+  long i;
+  VALUE vals;
+
+  vals = rb_ary_new_capa(nreq);
+  for(i = 0; i < nreq; i++) {
+    st_lookup(offsets, (st_data_t)reqs[i].k.packed, &off);
+    rb_ary_push(vals, off ?
+        rb_hps_record_value(buf+off-1, reqs[i].k.key, reqs[i].type) : Qnil);
+  }
+
+  st_free_table(offsets);
+
+  return vals;
+}
+
+/*
+ * call-seq:
+ *   hget_many(keys, type=:s) -> Array
+ *   hget_many(key_type_hash) -> Hash
+ *
+ * Gets the values of many keys with a single scan of the status buffer.
+ * +keys+ is an Array whose elements are either keys or [key, type] pairs,
+ * where +type+ is the suffix of the corresponding hget method (e.g. :i4,
+ * :r8, :s).  Keys given without a type are converted according to +type+.
+ * Returns an Array of values in the same order as +keys+.
+ *
+ * If a Hash mapping keys to types is given, a Hash mapping the same keys to
+ * values is returned.
+ *
+ * As with the hget methods, missing keys have a value of +nil+ and the status
+ * buffer should be locked by the caller.  If the key index is enabled (see
+ * #key_index=), keys are looked up via the index rather than by scanning.
+ */
+VALUE rb_hps_hget_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vkeys, vtype, vreqs, vreq, vkey, vals, vh, tmp;
+  enum rb_hps_type deftype;
+  struct rb_hps_key_req * reqs;
+  hashpipe_status_t *s;
+  long i, n;
+
+  rb_scan_args(argc, argv, "11", &vkeys, &vtype);
+
+  deftype = NIL_P(vtype) ? RB_HPS_TYPE_S : rb_hps_type_code(vtype);
+
+  if(RB_TYPE_P(vkeys, T_HASH))
+    vreqs = rb_funcall(vkeys, rb_intern("to_a"), 0);
+  else
+    vreqs = rb_Array(vkeys);
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  n = RARRAY_LEN(vreqs);
+  reqs = ALLOCV_N(struct rb_hps_key_req, tmp, n);
+
+  for(i = 0; i < n; i++) {
+    vreq = rb_ary_entry(vreqs, i);
+    if(RB_TYPE_P(vreq, T_ARRAY)) {
+      vkey = rb_ary_entry(vreq, 0);
+      reqs[i].type = rb_hps_type_code(rb_ary_entry(vreq, 1));
+    } else {
+      vkey = vreq;
+      reqs[i].type = deftype;
+    }
+    reqs[i].k = *rb_hps_get_key(vkey, &reqs[i].k);
+  }
+
+  if(RB_HPS_OBJ(s)->index) {
+    vals = rb_ary_new_capa(n);
+    for(i = 0; i < n; i++)
+      rb_ary_push(vals,
+          rb_hps_index_hget(RB_HPS_OBJ(s), &reqs[i].k, reqs[i].type));
+  } else {
+    vals = rb_hps_hget_reqs(s->buf, reqs, n);
+  }
+
+  ALLOCV_END(tmp);
+
+  if(RB_TYPE_P(vkeys, T_HASH)) {
+    vh = rb_hash_new();
+    for(i = 0; i < n; i++)
+      rb_hash_aset(vh, rb_ary_entry(rb_ary_entry(vreqs, i), 0),
+          rb_ary_entry(vals, i));
+    return vh;
+  }
+
+  return vals;
+}
+
+/*
+ * call-seq: fetch_numeric(keys, buf=nil) -> String
+ *
+ * Gets the values of the keys in the Array +keys+ (Strings, Symbols, or Key
+ * objects) as doubles with a single scan of the status buffer and returns
+ * them packed, in the same order as +keys+, in a binary String of native
+ * doubles (i.e. suitable for <tt>unpack('d*')</tt> or
+ * <tt>Numo::DFloat.from_binary</tt>).  The values are parsed in C and no Ruby
+ * object is created per value.  Missing keys and non-numeric values are NaN.
+ *
+ * If +buf+ is given, it is resized as needed, filled in, and returned instead
+ * of a new String, so repeated fetches of the same keys allocate nothing.
+ *
+ * As with #hget_many, the status buffer should be locked by the caller and the
+ * key index is used if enabled (see #key_index=).  See also #fetch_narray.
+ */
+VALUE rb_hps_fetch_numeric(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vkeys, vbuf, tmp;
+  struct rb_hps_key_req * reqs;
+  hashpipe_status_t *s;
+  st_table * offsets = NULL;
+  st_data_t off;
+  const char * rec;
+  double * vals;
+  long i, n;
+
+  rb_scan_args(argc, argv, "11", &vkeys, &vbuf);
+
+  vkeys = rb_Array(vkeys);
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  n = RARRAY_LEN(vkeys);
+  reqs = ALLOCV_N(struct rb_hps_key_req, tmp, n);
+
+  for(i = 0; i < n; i++) {
+    reqs[i].k = *rb_hps_get_key(rb_ary_entry(vkeys, i), &reqs[i].k);
+    reqs[i].type = RB_HPS_TYPE_R8;
+  }
+
+  if(NIL_P(vbuf)) {
+    vbuf = rb_str_new(NULL, n * sizeof(double));
+  } else {
+    StringValue(vbuf);
+    rb_str_modify(vbuf);
+    rb_str_resize(vbuf, n * sizeof(double));
+    rb_enc_associate(vbuf, rb_ascii8bit_encoding());
+  }
+  vals = (double *)RSTRING_PTR(vbuf);
+
+  if(!RB_HPS_OBJ(s)->index)
+    offsets = rb_hps_find_records(s->buf, reqs, n);
+
+  for(i = 0; i < n; i++) {
+    if(offsets)
+      rec = st_lookup(offsets, (st_data_t)reqs[i].k.packed, &off) && off ?
+        s->buf + off - 1 : NULL;
+    else
+      rec = rb_hps_index_lookup(RB_HPS_OBJ(s), &reqs[i].k);
+    vals[i] = rec ? rb_hps_record_r8(rec, reqs[i].k.key) : NAN;
+  }
+
+  if(offsets)
+    st_free_table(offsets);
+  ALLOCV_END(tmp);
+
+  return vbuf;
+}
+
+VALUE rb_hps_delete(VALUE self, VALUE vkey)
+{
+  hashpipe_status_t *s;
+  rb_hps_key_t tmp;
+  const rb_hps_key_t * k;
+  VALUE val;
+
+  // Get current value (to be returned)
+  val = rb_hps_hgets(self, vkey);
+  // If found,
+  if(RTEST(val)) {
+    // Delete key (already warned about truncation, if any)
+    k = rb_hps_get_key(vkey, &tmp);
+    Data_Get_HPStruct_Ensure_Attached(self, s);
+    hdel(s->buf, (char *)k->key);
+    RB_GC_GUARD(vkey);
+  }
+
+  return val;
+}
+
+#define HPUT(typecode, type, conv) \
+  VALUE rb_hps_hput##typecode(VALUE self, VALUE vkey, VALUE vval) \
+  { \
+    hashpipe_status_t *s; \
+    rb_hps_key_t tmp; \
+    const rb_hps_key_t * k = rb_hps_get_key(vkey, &tmp); \
+    type val; \
+    val = (type)conv(vval); \
+    Data_Get_HPStruct_Ensure_Attached(self, s); \
+    hput##typecode(s->buf, k->key, val); \
+    RB_GC_GUARD(vkey); \
+    return self; \
+  }
+
+HPUT(i4, int, NUM2INT)
+HPUT(u4, unsigned int, NUM2UINT)
+HPUT(i8, int8, NUM2INT8)
+HPUT(u8, uint8, NUM2UINT8)
+HPUT(r4, float, NUM2DBL)
+HPUT(r8, double, NUM2DBL)
+
+VALUE rb_hps_hputs(VALUE self, VALUE vkey, VALUE vval)
+{
+  int rc;
+  hashpipe_status_t *s;
+  rb_hps_key_t tmp;
+  const rb_hps_key_t * k = rb_hps_get_key(vkey, &tmp);
   const char * val = StringValueCStr(vval);
-  char * key = StringValueCStr(vkey);
-  if(strlen(key) > 8) {
-    rb_warning("key '%s' truncated to 8 characters", key);
-    save = key[8];
-    key[8] = '\0';
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+  rc = hputs(s->buf, k->key, val);
+  RB_GC_GUARD(vkey);
+  if(rc)
+    // Currently, the only error return is if header length is exceeded
+    rb_raise(rb_eRuntimeError, "header length exceeded");
+
+  return self;
+}
+
+struct rb_hps_diff_args {
+  VALUE self;
+  VALUE prev;
+};
+
+// Called via rb_hps_with_lock while status buffer is locked.
+static VALUE
+rb_hps_diff_locked(VALUE vargs)
+{
+  struct rb_hps_diff_args * args = (struct rb_hps_diff_args *)vargs;
+  hashpipe_status_t *s;
+  const char * buf, * rec;
+  const char * k0, * k1, * v0, * v1;
+  VALUE key, pval, added, changed, deleted, rest;
+  st_table * seen;
+  long len, nseen = 0;
+
+  Data_Get_HPStruct_Ensure_Attached(args->self, s);
+  buf = s->buf;
+  len = gethlength(s->buf);
+
+  added = rb_hash_new();
+  changed = rb_hash_new();
+
+  // Packed keys of records whose key is in prev, used to detect deletions
+  seen = st_init_numtable();
+
+  for(rec = buf; rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + len;
+      rec += HASHPIPE_STATUS_RECORD_SIZE) {
+    if(!strncmp(rec, "END ", 4))
+      break;
+
+    rb_hps_parse_record(rec, &k0, &k1, &v0, &v1);
+    key = RB_HPS_KEY_STR(k0, k1-k0);
+    pval = NIL_P(args->prev)
+      ? Qundef : rb_hash_lookup2(args->prev, key, Qundef);
+
+    if(pval == Qundef) {
+      rb_hash_aset(added, key, rb_str_new(v0, v1-v0));
+    } else {
+      if(!st_insert(seen, (st_data_t)rb_hps_pack_key(k0, k1-k0), 0))
+        nseen++;
+      if(!RB_TYPE_P(pval, T_STRING) || RSTRING_LEN(pval) != v1-v0 ||
+          memcmp(RSTRING_PTR(pval), v0, v1-v0))
+        rb_hash_aset(changed, key, rb_str_new(v0, v1-v0));
+    }
+  }
+
+  st_free_table(seen);
+
+  // If fewer distinct keys were seen than prev has, find the deleted keys by
+  // removing the current keys from a copy of prev.  The keys left over are
+  // the deleted ones.
+  if(!NIL_P(args->prev) && nseen < (long)RHASH_SIZE(args->prev)) {
+    rest = rb_hash_dup(args->prev);
+    for(rec = buf; rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + len;
+        rec += HASHPIPE_STATUS_RECORD_SIZE) {
+      if(!strncmp(rec, "END ", 4))
+        break;
+      rb_hps_parse_record(rec, &k0, &k1, &v0, &v1);
+      rb_hash_delete(rest, RB_HPS_KEY_STR(k0, k1-k0));
+    }
+    deleted = rb_funcall(rest, rb_intern("keys"), 0);
+  } else {
+    deleted = rb_ary_new();
+  }
+
+  return rb_ary_new_from_args(3, added, changed, deleted);
+}
+
+/*
+ * call-seq: diff(prev) -> [added, changed, deleted]
+ *
+ * Compares the current contents of the status buffer with +prev+, a Hash as
+ * returned by #to_hash (or +nil+ to treat everything as added).  Returns a
+ * three element Array: a Hash of keys (and values) that are not in +prev+, a
+ * Hash of keys whose values differ from those in +prev+ (with their current
+ * values), and an Array of the keys of +prev+ that are no longer present.
+ * Unchanged records are compared in place without creating any Strings.
+ * Applying the differences to +prev+ yields the same Hash as #to_hash.
+ *
+ * This call locks the status buffer internally so #lock must not be called
+ * prior to calling #diff.
+ */
+VALUE rb_hps_diff(VALUE self, VALUE vprev)
+{
+  struct rb_hps_diff_args args;
+
+  if(!NIL_P(vprev))
+    Check_Type(vprev, T_HASH);
+
+  args.self = self;
+  args.prev = vprev;
+
+  return rb_hps_with_lock(self, rb_hps_diff_locked, (VALUE)&args);
+}
+
+// A single key/value update of hput_many.  Values are converted to C types
+// (and Strings copied) while holding the GVL so that all updates can then be
+// applied under one lock without the GVL.
+struct rb_hps_put {
+  rb_hps_key_t k;
+  enum rb_hps_type type;
+  union {
+    int i4;
+    unsigned int u4;
+    int8 i8;
+    uint8 u8;
+    float r4;
+    double r8;
+  } num;
+  char str[HASHPIPE_STATUS_RECORD_SIZE];
+};
+
+struct rb_hps_put_many_args {
+  hashpipe_status_t * s;
+  struct rb_hps_put * updates;
+  long n;
+  long failed; // Index of failed put or -1
+};
+
+// This is called by rb_thread_blocking_region withOUT GVL.
+// Returns Qtrue on lock error, Qfalse on OK.
+static BLOCKING_TYPE
+rb_hps_put_many_blocking_func(void * vargs)
+{
+  struct rb_hps_put_many_args * args = (struct rb_hps_put_many_args *)vargs;
+  struct rb_hps_put * p;
+  long i;
+
+  if(rb_hps_lock_nogvl(args->s, NULL))
+    return (BLOCKING_TYPE)Qtrue;
+
+  for(i = 0; i < args->n; i++) {
+    p = args->updates + i;
+    switch(p->type) {
+      case RB_HPS_TYPE_I4: hputi4(args->s->buf, p->k.key, p->num.i4); break;
+      case RB_HPS_TYPE_I8: hputi8(args->s->buf, p->k.key, p->num.i8); break;
+      case RB_HPS_TYPE_U4: hputu4(args->s->buf, p->k.key, p->num.u4); break;
+      case RB_HPS_TYPE_U8: hputu8(args->s->buf, p->k.key, p->num.u8); break;
+      case RB_HPS_TYPE_R4: hputr4(args->s->buf, p->k.key, p->num.r4); break;
+      case RB_HPS_TYPE_R8: hputr8(args->s->buf, p->k.key, p->num.r8); break;
+      case RB_HPS_TYPE_S:
+        if(hputs(args->s->buf, p->k.key, p->str)) {
+          args->failed = i;
+          i = args->n; // Stop at first failure
+        }
+        break;
+    }
+  }
+
+  rb_hps_unlock_nogvl(args->s);
+
+  return (BLOCKING_TYPE)Qfalse;
+}
+
+/*
+ * call-seq: hput_many(hash, types={}) -> self
+ *
+ * Stores all key/value pairs of +hash+ in the status buffer under a single
+ * lock.  The type used to store each value is taken from +types+, a Hash
+ * mapping keys to the suffixes of the corresponding hput methods (e.g. :i4,
+ * :r8, :s).  For keys not in +types+, Integer values are stored as i8, Float
+ * values as r8, and all other values are stored as Strings (via +to_s+).
+ *
+ * This call locks the status buffer internally so #lock must not be called
+ * prior to calling #hput_many.
+ */
+VALUE rb_hps_hput_many(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vhash, vtypes, vpairs, vkey, vval, vtype, tmp;
+  VALUE vrc;
+  struct rb_hps_put * updates, * p;
+  struct rb_hps_put_many_args args;
+  hashpipe_status_t *s;
+  long i, n;
+
+  rb_scan_args(argc, argv, "11", &vhash, &vtypes);
+
+  vpairs = rb_funcall(rb_convert_type(vhash, T_HASH, "Hash", "to_hash"),
+      rb_intern("to_a"), 0);
+  if(!NIL_P(vtypes))
+    Check_Type(vtypes, T_HASH);
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  n = RARRAY_LEN(vpairs);
+  updates = ALLOCV_N(struct rb_hps_put, tmp, n);
+
+  for(i = 0; i < n; i++) {
+    p = updates + i;
+    vkey = rb_ary_entry(rb_ary_entry(vpairs, i), 0);
+    vval = rb_ary_entry(rb_ary_entry(vpairs, i), 1);
+    vtype = NIL_P(vtypes) ? Qnil : rb_hash_lookup(vtypes, vkey);
+
+    if(!NIL_P(vtype))
+      p->type = rb_hps_type_code(vtype);
+    else if(RB_INTEGER_TYPE_P(vval))
+      p->type = RB_HPS_TYPE_I8;
+    else if(RB_FLOAT_TYPE_P(vval))
+      p->type = RB_HPS_TYPE_R8;
+    else
+      p->type = RB_HPS_TYPE_S;
+
+    switch(p->type) {
+      case RB_HPS_TYPE_I4: p->num.i4 = NUM2INT(vval);      break;
+      case RB_HPS_TYPE_I8: p->num.i8 = NUM2INT8(vval);     break;
+      case RB_HPS_TYPE_U4: p->num.u4 = NUM2UINT(vval);     break;
+      case RB_HPS_TYPE_U8: p->num.u8 = NUM2UINT8(vval);    break;
+      case RB_HPS_TYPE_R4: p->num.r4 = (float)NUM2DBL(vval); break;
+      case RB_HPS_TYPE_R8: p->num.r8 = NUM2DBL(vval);      break;
+      case RB_HPS_TYPE_S:
+        vval = rb_obj_as_string(vval);
+        strncpy(p->str, StringValueCStr(vval), sizeof(p->str));
+        p->str[sizeof(p->str)-1] = '\0';
+        break;
+    }
+
+    p->k = *rb_hps_get_key(vkey, &p->k);
+  }
+
+  args.s = s;
+  args.updates = updates;
+  args.n = n;
+  args.failed = -1;
+
+  vrc = (VALUE)rb_thread_blocking_region(
+      rb_hps_put_many_blocking_func, &args,
+      RUBY_UBF_PROCESS, NULL);
+
+  ALLOCV_END(tmp);
+
+  if(RTEST(vrc))
+    rb_raise(rb_eRuntimeError, "lock error");
+
+  if(args.failed >= 0)
+    // Currently, the only error return is if header length is exceeded
+    rb_raise(rb_eRuntimeError, "header length exceeded");
+
+  return self;
+}
+
+struct rb_hps_snapshot_args {
+  hashpipe_status_t * s;
+  struct timespec deadline;
+  int use_deadline;
+  int rc;            // One of the RB_HPS_LOCK_* values
+  char * buf;        // Copy of status buffer (NULL if not copied)
+  struct timespec time;
+};
+
+// Copies the status buffer of s (up to and including the END record) into a
+// newly malloc'd, zero padded buffer whose contents are parseable by the
+// fitshead functions.  Must be called with s locked.  Returns NULL if out of
+// memory.  May be called without the GVL.
+static char *
+rb_hps_copy_buf(hashpipe_status_t * s)
+{
+  char * buf;
+  size_t len, size;
+
+  len = gethlength(s->buf);
+  if(len > HASHPIPE_STATUS_TOTAL_SIZE)
+    len = HASHPIPE_STATUS_TOTAL_SIZE;
+  // Round up to whole records plus a terminating NUL
+  size = (len + HASHPIPE_STATUS_RECORD_SIZE - 1)
+       / HASHPIPE_STATUS_RECORD_SIZE * HASHPIPE_STATUS_RECORD_SIZE + 1;
+
+  buf = malloc(size);
+  if(buf) {
+    memcpy(buf, s->buf, len);
+    memset(buf + len, 0, size - len);
+  }
+
+  return buf;
+}
+
+// This is called by rb_thread_blocking_region withOUT GVL.
+// Returns Qnil always (results are stored in args).
+static BLOCKING_TYPE
+rb_hps_snapshot_blocking_func(void * vargs)
+{
+  struct rb_hps_snapshot_args * args = (struct rb_hps_snapshot_args *)vargs;
+
+  args->buf = NULL;
+  args->rc = rb_hps_lock_nogvl(args->s,
+      args->use_deadline ? &args->deadline : NULL);
+
+  if(args->rc == RB_HPS_LOCK_OK) {
+    args->buf = rb_hps_copy_buf(args->s);
+    clock_gettime(CLOCK_REALTIME, &args->time);
+    rb_hps_unlock_nogvl(args->s);
+  }
+
+  return (BLOCKING_TYPE)Qnil;
+}
+
+// Returns a new frozen Snapshot that takes ownership of buf, a copy of the
+// status buffer of instance_id made at time.
+static VALUE
+rb_hps_snapshot_new(int instance_id, char * buf, const struct timespec * time)
+{
+  rb_hps_t * p;
+  VALUE v;
+
+  v = Data_Make_Struct(cSnapshot, rb_hps_t, rb_hps_mark, rb_hps_free, p);
+  memset(p, 0, sizeof(rb_hps_t));
+  p->view = Qnil;
+  p->view_owner = Qnil;
+  p->s.instance_id = instance_id;
+  p->s.buf = buf;
+  p->owns_buf = 1;
+  p->time = *time;
+
+  return rb_obj_freeze(v);
+}
+
+/*
+ * call-seq: snapshot(timeout: nil) -> Snapshot or nil
+ *
+ * Returns a Snapshot holding a copy of the current contents of the status
+ * buffer.  The status buffer is locked (without the GVL) only for as long as
+ * it takes to copy it, so reading many values from the Snapshot does not
+ * prolong the time that the status buffer is locked.  If +timeout+ is given,
+ * returns +nil+ if the lock could not be acquired within +timeout+ seconds.
+ *
+ * This call locks the status buffer internally so #lock must not be called
+ * prior to calling #snapshot.
+ */
+VALUE rb_hps_snapshot(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vopts;
+  struct rb_hps_snapshot_args args;
+  hashpipe_status_t *s;
+
+  rb_scan_args(argc, argv, "0:", &vopts);
+
+  Data_Get_HPStruct_Ensure_Attached(self, s);
+
+  args.s = s;
+  args.use_deadline = rb_hps_get_deadline(vopts, &args.deadline);
+
+  rb_thread_blocking_region(
+      rb_hps_snapshot_blocking_func, &args,
+      RUBY_UBF_PROCESS, NULL);
+
+  if(args.rc == RB_HPS_LOCK_TIMEDOUT)
+    return Qnil;
+  if(args.rc != RB_HPS_LOCK_OK)
+    rb_raise(rb_eRuntimeError, "lock error");
+  if(!args.buf)
+    rb_memerror();
+
+  return rb_hps_snapshot_new(s->instance_id, args.buf, &args.time);
+}
+
+/*
+ * call-seq: to_hash -> Hash
+ *
+ * Returns the contents of the snapshot as a Hash.  Keys are frozen Strings.
+ */
+VALUE rb_hps_snapshot_to_hash(VALUE self)
+{
+  hashpipe_status_t *s;
+
+  Data_Get_HPStruct(self, s);
+  return rb_hps_records_to_hash(s->buf, gethlength(s->buf));
+}
+
+/*
+ * call-seq: diff(prev) -> [added, changed, deleted]
+ *
+ * Compares the contents of the snapshot with +prev+.  See Status#diff.
+ */
+VALUE rb_hps_snapshot_diff(VALUE self, VALUE vprev)
+{
+  struct rb_hps_diff_args args;
+
+  if(!NIL_P(vprev))
+    Check_Type(vprev, T_HASH);
+
+  args.self = self;
+  args.prev = vprev;
+
+  return rb_hps_diff_locked((VALUE)&args);
+}
+
+/*
+ * call-seq: time -> Time
+ *
+ * Returns the time at which the snapshot was taken.
+ */
+VALUE rb_hps_snapshot_time(VALUE self)
+{
+  rb_hps_t *p;
+
+  Data_Get_HPObj(self, p);
+  return rb_time_nano_new(p->time.tv_sec, p->time.tv_nsec);
+}
+
+/*
+ * Document-class: Hashpipe::StatusSet
+ *
+ * A +StatusSet+ object holds a fixed list of Status objects so that all of
+ * them can be snapshot at once.  The snapshots are taken without the GVL by a
+ * small pool of threads so a status buffer that is locked for a long time
+ * does not delay the snapshots of the others.  The pool threads are started
+ * by the first #snapshot that needs them and then sleep between snapshots
+ * until the StatusSet is garbage collected, so snapshotting a set every tick
+ * does not create and join threads every tick.
+ */
+
+// Default maximum number of threads used by StatusSet#snapshot
+#define RB_HPS_SET_DEFAULT_THREADS 8
+
+struct rb_hps_set_snapshot_args;
+
+// Persistent snapshot thread pool of a Hashpipe::StatusSet object.  The pool
+// threads wait on cond for a round (one StatusSet#snapshot) to start.  Up to
+// wanted threads join each round, taking snapshots from work alongside the
+// calling thread.  All fields are protected by mutex.
+struct rb_hps_set_pool {
+  pthread_mutex_t mutex;
+  // Signaled when a round starts or the pool is shut down
+  pthread_cond_t cond;
+  // Signaled when the last pool thread working on a round is done
+  pthread_cond_t done;
+  // Pool threads (nthreads of them started, room for capacity)
+  pthread_t * threads;
+  int nthreads;
+  int capacity;
+  // Process that started the pool threads
+  pid_t pid;
+  // Number of the current (or last) round, starting at 1
+  unsigned long round;
+  // Work of the current round and the number of pool threads wanted for,
+  // joined (claimed), and still working on it (running)
+  struct rb_hps_set_snapshot_args * work;
+  int wanted;
+  int claimed;
+  int running;
+  // Nonzero while a round is in progress
+  int busy;
+  // Nonzero when the pool threads should exit
+  int shutdown;
+};
+
+// Per-object state of a Hashpipe::StatusSet object.
+typedef struct {
+  // Frozen Array of Hashpipe::Status objects
+  VALUE statuses;
+  // Maximum number of threads to use for snapshots
+  int max_threads;
+  // Snapshot thread pool (NULL until first needed)
+  struct rb_hps_set_pool * pool;
+} rb_hps_set_t;
+
+#define Data_Get_HPSet(self, p) \
+  Data_Get_Struct(self, rb_hps_set_t, p);
+
+static void
+rb_hps_set_mark(void * p)
+{
+  rb_gc_mark(((rb_hps_set_t *)p)->statuses);
+}
+
+// Stops and joins the pool threads and frees the pool.  The threads of a pool
+// inherited over fork do not exist in this process, so they are not joined.
+static void
+rb_hps_set_pool_free(struct rb_hps_set_pool * pool)
+{
+  int i;
+
+  if(pool->pid == getpid()) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i = 0; i < pool->nthreads; i++)
+      pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+  }
+  free(pool->threads);
+  xfree(pool);
+}
+
+static void
+rb_hps_set_free(void * vp)
+{
+  rb_hps_set_t * p = (rb_hps_set_t *)vp;
+
+  if(p->pool)
+    rb_hps_set_pool_free(p->pool);
+  xfree(p);
+}
+
+static VALUE
+rb_hps_set_alloc(VALUE klass)
+{
+  rb_hps_set_t * p;
+  VALUE v;
+
+  v = Data_Make_Struct(klass, rb_hps_set_t, rb_hps_set_mark, rb_hps_set_free,
+      p);
+  p->statuses = rb_ary_new();
+  p->max_threads = RB_HPS_SET_DEFAULT_THREADS;
+  return v;
+}
+
+/*
+ * call-seq: StatusSet.new(instances, create=false) -> StatusSet
+ *
+ * Creates a StatusSet for +instances+, an Array whose elements are Status
+ * objects or instance ids.  A Status object is created (and attached) for
+ * each instance id, passing +create+ to Status.new.
+ */
+VALUE rb_hps_set_init(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vinstances, vcreate, vstatuses, v;
+  VALUE args[2];
+  rb_hps_set_t * p;
+  long i;
+
+  rb_scan_args(argc, argv, "11", &vinstances, &vcreate);
+  vinstances = rb_Array(vinstances);
+
+  vstatuses = rb_ary_new_capa(RARRAY_LEN(vinstances));
+  for(i = 0; i < RARRAY_LEN(vinstances); i++) {
+    v = rb_ary_entry(vinstances, i);
+    if(!rb_obj_is_kind_of(v, cStatus)) {
+      args[0] = v;
+      args[1] = vcreate;
+      v = rb_class_new_instance(2, args, cStatus);
+    }
+    rb_ary_push(vstatuses, v);
+  }
+
+  Data_Get_HPSet(self, p);
+  p->statuses = rb_obj_freeze(vstatuses);
+
+  return self;
+}
+
+/*
+ * call-seq: statuses -> Array
+ *
+ * Returns the (frozen) Array of Status objects in the set.
+ */
+VALUE rb_hps_set_statuses(VALUE self)
+{
+  rb_hps_set_t * p;
+
+  Data_Get_HPSet(self, p);
+  return p->statuses;
+}
+
+/*
+ * call-seq: max_threads -> Integer
+ *
+ * Returns the maximum number of threads used to take snapshots.
+ */
+VALUE rb_hps_set_max_threads(VALUE self)
+{
+  rb_hps_set_t * p;
+
+  Data_Get_HPSet(self, p);
+  return INT2NUM(p->max_threads);
+}
+
+/*
+ * call-seq: max_threads = n -> n
+ *
+ * Sets the maximum number of threads used to take snapshots.  Setting it to 1
+ * takes the snapshots sequentially (still without the GVL).
+ */
+VALUE rb_hps_set_set_max_threads(VALUE self, VALUE vn)
+{
+  rb_hps_set_t * p;
+  int n = NUM2INT(vn);
+
+  if(n < 1)
+    rb_raise(rb_eArgError, "max_threads must be positive");
+
+  Data_Get_HPSet(self, p);
+  p->max_threads = n;
+
+  return vn;
+}
+
+struct rb_hps_set_snapshot_args {
+  struct rb_hps_snapshot_args * snaps;
+  long count;
+  long next;         // Index of next snapshot to take (shared by threads)
+};
+
+// Thread function of the snapshot thread pool.  Takes snapshots until there
+// are none left to take.  Runs without the GVL.
+static void *
+rb_hps_set_snapshot_worker(void * vargs)
+{
+  struct rb_hps_set_snapshot_args * args =
+    (struct rb_hps_set_snapshot_args *)vargs;
+  long i;
+
+  while((i = __sync_fetch_and_add(&args->next, 1)) < args->count)
+    rb_hps_snapshot_blocking_func(&args->snaps[i]);
+
+  return NULL;
+}
+
+// Thread function of the pool threads.  Joins each round (if it is still
+// wanted) until the pool is shut down.  Runs without the GVL.
+static void *
+rb_hps_set_pool_thread(void * vpool)
+{
+  struct rb_hps_set_pool * pool = (struct rb_hps_set_pool *)vpool;
+  struct rb_hps_set_snapshot_args * work;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  for(;;) {
+    while(!pool->shutdown
+        && (pool->round == seen || pool->claimed >= pool->wanted))
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if(pool->shutdown)
+      break;
+
+    seen = pool->round;
+    pool->claimed++;
+    pool->running++;
+    work = pool->work;
+    pthread_mutex_unlock(&pool->mutex);
+
+    rb_hps_set_snapshot_worker(work);
+
+    pthread_mutex_lock(&pool->mutex);
+    if(--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+// Returns the snapshot thread pool of p, creating it if needed.  A pool
+// inherited over fork (whose threads exist only in the parent) is abandoned
+// and replaced, since its mutex may have been held at the time of the fork.
+static struct rb_hps_set_pool *
+rb_hps_set_get_pool(rb_hps_set_t * p)
+{
+  struct rb_hps_set_pool * pool = p->pool;
+
+  if(pool && pool->pid == getpid())
+    return pool;
+
+  pool = ALLOC(struct rb_hps_set_pool);
+  memset(pool, 0, sizeof(struct rb_hps_set_pool));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->pid = getpid();
+  p->pool = pool;
+
+  return pool;
+}
+
+struct rb_hps_set_pool_args {
+  struct rb_hps_set_pool * pool;
+  struct rb_hps_set_snapshot_args * work;
+  int nthreads;
+};
+
+// Starts pool threads (if needed) until pool has n of them.  Called with the
+// pool mutex held.  If a thread cannot be started, the pool just has fewer.
+static void
+rb_hps_set_pool_grow(struct rb_hps_set_pool * pool, int n)
+{
+  pthread_t * threads;
+
+  while(pool->nthreads < n) {
+    if(pool->nthreads == pool->capacity) {
+      // Plain realloc since this runs without the GVL
+      threads = realloc(pool->threads, 2 * n * sizeof(pthread_t));
+      if(!threads)
+        return;
+      pool->threads = threads;
+      pool->capacity = 2 * n;
+    }
+    if(pthread_create(&pool->threads[pool->nthreads], NULL,
+          rb_hps_set_pool_thread, pool))
+      return;
+    pool->nthreads++;
+  }
+}
+
+// This is called by rb_thread_blocking_region withOUT GVL.
+// Starts a round in which nthreads-1 pool threads help the calling thread take
+// the snapshots, and waits for the pool threads to finish.  If the pool is
+// already busy (with a snapshot of the set by another Ruby thread) or none of
+// its threads could be started, the calling thread takes all of the snapshots
+// itself.  Returns Qnil always.
+static BLOCKING_TYPE
+rb_hps_set_snapshot_blocking_func(void * vargs)
+{
+  struct rb_hps_set_pool_args * args = (struct rb_hps_set_pool_args *)vargs;
+  struct rb_hps_set_pool * pool = args->pool;
+
+  if(!pool) {
+    rb_hps_set_snapshot_worker(args->work);
+    return (BLOCKING_TYPE)Qnil;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if(pool->busy) {
+    pthread_mutex_unlock(&pool->mutex);
+    rb_hps_set_snapshot_worker(args->work);
+    return (BLOCKING_TYPE)Qnil;
+  }
+
+  rb_hps_set_pool_grow(pool, args->nthreads - 1);
+  pool->busy = 1;
+  pool->work = args->work;
+  pool->wanted = args->nthreads - 1 < pool->nthreads
+    ? args->nthreads - 1 : pool->nthreads;
+  pool->claimed = 0;
+  pool->round++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  rb_hps_set_snapshot_worker(args->work);
+
+  // Let no more pool threads join this round and wait for those that did
+  pthread_mutex_lock(&pool->mutex);
+  pool->wanted = 0;
+  while(pool->running > 0)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pool->busy = 0;
+  pthread_mutex_unlock(&pool->mutex);
+
+  return (BLOCKING_TYPE)Qnil;
+}
+
+/*
+ * call-seq: snapshot(timeout: nil) -> Array
+ *
+ * Returns an Array containing a Snapshot of each Status in the set (in the
+ * same order as #statuses).  The snapshots are taken without the GVL by up to
+ * #max_threads threads.  If +timeout+ is given, the element for any status
+ * buffer that could not be locked within +timeout+ seconds is +nil+.  Raises
+ * RuntimeError if any status buffer is not attached or fails to lock.
+ *
+ * As with Status#snapshot, none of the status buffers may be locked by the
+ * calling thread.
+ */
+VALUE rb_hps_set_snapshot(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vopts, vstatuses, vsnaps, tmp;
+  rb_hps_set_t * p;
+  hashpipe_status_t * s;
+  struct rb_hps_snapshot_args * snaps;
+  struct rb_hps_set_snapshot_args work;
+  struct rb_hps_set_pool_args pool;
+  struct timespec deadline = {0, 0};
+  int use_deadline, failed = 0;
+  long i, n;
+
+  rb_scan_args(argc, argv, "0:", &vopts);
+  use_deadline = rb_hps_get_deadline(vopts, &deadline);
+
+  Data_Get_HPSet(self, p);
+  vstatuses = p->statuses;
+  n = RARRAY_LEN(vstatuses);
+
+  snaps = ALLOCV_N(struct rb_hps_snapshot_args, tmp, n);
+  for(i = 0; i < n; i++) {
+    Data_Get_HPStruct_Ensure_Attached(RARRAY_AREF(vstatuses, i), s);
+    snaps[i].s = s;
+    snaps[i].deadline = deadline;
+    snaps[i].use_deadline = use_deadline;
+  }
+
+  work.snaps = snaps;
+  work.count = n;
+  work.next = 0;
+
+  pool.work = &work;
+  pool.nthreads = n < p->max_threads ? (int)n : p->max_threads;
+  pool.pool = pool.nthreads > 1 ? rb_hps_set_get_pool(p) : NULL;
+
+  rb_thread_blocking_region(
+      rb_hps_set_snapshot_blocking_func, &pool,
+      RUBY_UBF_PROCESS, NULL);
+
+  // Wrap all copies first so none are leaked if we end up raising
+  vsnaps = rb_ary_new_capa(n);
+  for(i = 0; i < n; i++) {
+    if(snaps[i].rc != RB_HPS_LOCK_OK || !snaps[i].buf) {
+      if(!failed && snaps[i].rc != RB_HPS_LOCK_TIMEDOUT)
+        failed = snaps[i].rc == RB_HPS_LOCK_OK ? 2 : 1;
+      rb_ary_push(vsnaps, Qnil);
+    } else {
+      rb_ary_push(vsnaps, rb_hps_snapshot_new(
+            snaps[i].s->instance_id, snaps[i].buf, &snaps[i].time));
+    }
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(vstatuses);
+
+  if(failed == 1)
+    rb_raise(rb_eRuntimeError, "lock error");
+  if(failed == 2)
+    rb_memerror();
+
+  return vsnaps;
+}
+
+/*
+ * call-seq: wait_for_change(timeout=nil, tokens=nil) -> Array or nil
+ *
+ * Waits (without the GVL) until the contents of any status buffer in the set
+ * differ from those fingerprinted by the corresponding element of +tokens+,
+ * an Array of checksums in the same order as #statuses (such as a previous
+ * return value of this method).  A +nil+ +tokens+ (or +nil+ element) means
+ * the contents at the time of the call.  Returns an Array of the checksums of
+ * all status buffers, in which at least one differs from +tokens+, or +nil+
+ * if no change occurs within +timeout+ seconds (waits forever if +timeout+ is
+ * +nil+).  See Status#wait_for_change.
+ */
+VALUE rb_hps_set_wait_for_change(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vtimeout, vtokens, vtoken, vstatuses, vsums, tmp;
+  rb_hps_set_t * p;
+  struct rb_hps_watch * watch;
+  hashpipe_status_t * s;
+  long i, n;
+
+  rb_scan_args(argc, argv, "02", &vtimeout, &vtokens);
+  if(!NIL_P(vtokens))
+    Check_Type(vtokens, T_ARRAY);
+
+  Data_Get_HPSet(self, p);
+  vstatuses = p->statuses;
+  n = RARRAY_LEN(vstatuses);
+
+  watch = ALLOCV_N(struct rb_hps_watch, tmp, n);
+  for(i = 0; i < n; i++) {
+    Data_Get_HPStruct_Ensure_Attached(RARRAY_AREF(vstatuses, i), s);
+    vtoken = NIL_P(vtokens) ? Qnil : rb_ary_entry(vtokens, i);
+    watch[i].s = s;
+    watch[i].checksum = NIL_P(vtoken)
+      ? rb_hps_checksum(s->buf, gethlength(s->buf))
+      : NUM2ULL(vtoken);
+  }
+
+  vsums = Qnil;
+  if(rb_hps_wait_for_change(watch, n, vtimeout)) {
+    vsums = rb_ary_new_capa(n);
+    for(i = 0; i < n; i++)
+      rb_ary_push(vsums, ULL2NUM(watch[i].checksum));
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(vstatuses);
+
+  return vsums;
+}
+
+/*
+ * Document-class: Hashpipe::Recorder
+ *
+ * A +Recorder+ object samples the values of selected keys of a status buffer
+ * at a fixed rate and stores them as timestamped records in a preallocated
+ * ring buffer.  Sampling is done by a background thread that runs without the
+ * GVL, so high sampling rates (e.g. 100 Hz) capture short transients that
+ * periodic snapshots miss.  The ring buffer is memory mapped from a file (or
+ * from anonymous shared memory if no file is given) so it can be dumped or
+ * streamed while recording and, if backed by a file, read back after the
+ * fact with Hashpipe::RecorderFile.
+ */
+
+#define RB_HPS_REC_MAGIC "HPRECRD"
+#define RB_HPS_REC_VERSION 1
+#define RB_HPS_REC_DEFAULT_CAPACITY 65536
+#define RB_HPS_REC_DEFAULT_RATE 100.0
+
+// Header of a recorder ring buffer (and file).  All fields are native endian.
+// The header is followed by the nkeys keys (8 characters each, space padded)
+// and then, at data_offset, by capacity records of record_size bytes.  Each
+// record holds the CLOCK_REALTIME time of the sample in nanoseconds (int64_t)
+// followed by one double per key (NaN for missing or non-numeric values).
+// Record number n (counting from 0) is stored at index n % capacity, so the
+// valid records are numbers max(0, head-capacity) through head-1.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nkeys;
+  uint64_t capacity;
+  uint64_t record_size;
+  uint64_t data_offset;
+  double rate;
+  // Number of records written so far
+  volatile uint64_t head;
+  // Number of samples missed (due to overruns or lock timeouts)
+  volatile uint64_t missed;
+} rb_hps_rec_header_t;
+
+// Per-object state of a Hashpipe::Recorder object.
+typedef struct rb_hps_rec {
+  // Status object being recorded and the Recorder's own reference to its
+  // pooled attachment (so that the status buffer stays attached while the
+  // Recorder exists, regardless of what happens to the Status object)
+  VALUE status;
+  rb_hps_t hps;
+  // Frozen Array of the recorded keys (as Strings) and their rb_hps_key_t
+  VALUE keys;
+  rb_hps_key_t * k;
+  int nkeys;
+  // Cached record offset of each key in the status buffer (-1 if unknown)
+  long * offsets;
+  // File backing the ring buffer (nil for anonymous memory) and its mapping
+  VALUE path;
+  int fd;
+  rb_hps_rec_header_t * hdr;
+  size_t map_size;
+  // Sampling thread, the process that started it, and its stop request flag
+  pthread_t thread;
+  pid_t pid;
+  int running;
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Links in the list of all Recorder objects
+  struct rb_hps_rec * prev;
+  struct rb_hps_rec * next;
+} rb_hps_rec_t;
+
+#define Data_Get_HPRec(self, p) \
+  Data_Get_Struct(self, rb_hps_rec_t, p);
+
+// Returns a pointer to the record at index i of the ring buffer of p.
+#define RB_HPS_REC_AT(p, i) \
+  ((char *)(p)->hdr + (p)->hdr->data_offset + (i) * (p)->hdr->record_size)
+
+static VALUE cRecorder;
+
+// List of all Recorder objects of this process.  Only accessed with the GVL.
+static rb_hps_rec_t * rb_hps_recorders = NULL;
+
+// Initializes the mutex and condition variable of p.  Sampling times are on
+// the monotonic clock.
+static void
+rb_hps_rec_init_sync(rb_hps_rec_t * p)
+{
+  pthread_condattr_t attr;
+
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&p->cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Forgets the sampling thread of p if it was started by another process,
+// i.e. if p was inherited over fork.  The thread does not exist in this
+// process (so it must not be joined) and its mutex may have been locked when
+// the process forked, so the mutex and condition variable are reinitialized.
+static void
+rb_hps_rec_check_fork(rb_hps_rec_t * p)
+{
+  if(p->running && p->pid != getpid()) {
+    p->running = 0;
+    rb_hps_rec_init_sync(p);
+  }
+}
+
+// Marks all Recorders inherited over fork as stopped.  Called by
+// Status.after_fork.
+static void
+rb_hps_rec_after_fork(void)
+{
+  rb_hps_rec_t * p;
+
+  for(p = rb_hps_recorders; p; p = p->next)
+    rb_hps_rec_check_fork(p);
+}
+
+// Adds ns nanoseconds to *ts.
+static void
+rb_hps_timespec_add_ns(struct timespec * ts, long long ns)
+{
+  ns += ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000LL;
+  ts->tv_nsec = ns % 1000000000LL;
+}
+
+// This is called by rb_thread_blocking_region withOUT GVL (or from the free
+// function).  Stops the sampling thread of p (if running) and waits for it to
+// exit.  Returns Qnil always.
+static BLOCKING_TYPE
+rb_hps_rec_stop_blocking_func(void * vp)
+{
+  rb_hps_rec_t * p = (rb_hps_rec_t *)vp;
+
+  rb_hps_rec_check_fork(p);
+  if(p->running) {
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, NULL);
+    p->running = 0;
+  }
+
+  return (BLOCKING_TYPE)Qnil;
+}
+
+static void
+rb_hps_rec_mark(void * vp)
+{
+  rb_hps_rec_t * p = (rb_hps_rec_t *)vp;
+
+  rb_gc_mark(p->status);
+  rb_gc_mark(p->keys);
+  rb_gc_mark(p->path);
+}
+
+static void
+rb_hps_rec_free(void * vp)
+{
+  rb_hps_rec_t * p = (rb_hps_rec_t *)vp;
+
+  rb_hps_rec_stop_blocking_func(p);
+  if(p->hps.att)
+    rb_hps_att_release(&p->hps);
+  if(p->prev)
+    p->prev->next = p->next;
+  else
+    rb_hps_recorders = p->next;
+  if(p->next)
+    p->next->prev = p->prev;
+  if(p->hdr)
+    munmap(p->hdr, p->map_size);
+  if(p->fd >= 0)
+    close(p->fd);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->mutex);
+  xfree(p->k);
+  xfree(p->offsets);
+  xfree(p);
+}
+
+static VALUE
+rb_hps_rec_alloc(VALUE klass)
+{
+  rb_hps_rec_t * p;
+  VALUE v;
+
+  v = Data_Make_Struct(klass, rb_hps_rec_t, rb_hps_rec_mark, rb_hps_rec_free,
+      p);
+  memset(p, 0, sizeof(rb_hps_rec_t));
+  p->status = Qnil;
+  p->hps.view = Qnil;
+  p->hps.view_owner = Qnil;
+  p->keys = Qnil;
+  p->path = Qnil;
+  p->fd = -1;
+  rb_hps_rec_init_sync(p);
+  p->next = rb_hps_recorders;
+  if(p->next)
+    p->next->prev = p;
+  rb_hps_recorders = p;
+  return v;
+}
+
+// Returns the value of key i of p in buf (the locked status buffer) as a
+// double, or NaN if the key is not found or its value is not numeric.  The
+// record offset of each key is cached and only searched for again when the
+// record at the cached offset no longer holds the key.  Runs without the GVL.
+static double
+rb_hps_rec_value(rb_hps_rec_t * p, int i, const char * buf)
+{
+  const rb_hps_key_t * k = &p->k[i];
+  const char * rec;
+  long off = p->offsets[i];
+
+  if(off < 0 || rb_hps_pack_key(buf + off, 8) != k->packed) {
+    off = -1;
+    for(rec = buf; *rec && strncmp(rec, "END ", 4) &&
+        rec + HASHPIPE_STATUS_RECORD_SIZE <= buf + HASHPIPE_STATUS_TOTAL_SIZE;
+        rec += HASHPIPE_STATUS_RECORD_SIZE) {
+      if(rb_hps_pack_key(rec, 8) == k->packed) {
+        off = rec - buf;
+        break;
+      }
+    }
+    p->offsets[i] = off;
+    if(off < 0)
+      return NAN;
+  }
+
+  return rb_hps_record_r8(buf + off, k->key);
+}
+
+// Takes one sample of the keys of p and appends it to the ring buffer.  The
+// status buffer lock is waited for for at most timeout seconds; if it is not
+// obtained, the sample is counted as missed.  Runs without the GVL.
+static void
+rb_hps_rec_sample(rb_hps_rec_t * p, double timeout)
+{
+  rb_hps_rec_header_t * hdr = p->hdr;
+  struct timespec deadline, now;
+  uint64_t head = hdr->head;
+  char * rec = RB_HPS_REC_AT(p, head % hdr->capacity);
+  double * values = (double *)(rec + sizeof(int64_t));
+  int64_t ns;
+  int i;
+
+  rb_hps_deadline(timeout, &deadline);
+  if(!p->hps.s.buf ||
+      rb_hps_lock_nogvl(&p->hps.s, &deadline) != RB_HPS_LOCK_OK) {
+    hdr->missed++;
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  for(i = 0; i < p->nkeys; i++)
+    values[i] = rb_hps_rec_value(p, i, p->hps.s.buf);
+
+  rb_hps_unlock_nogvl(&p->hps.s);
+
+  ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+  memcpy(rec, &ns, sizeof(ns));
+
+  // Make the record visible before publishing it via head
+  __sync_synchronize();
+  hdr->head = head + 1;
+}
+
+// Thread function of the sampling thread.  Samples on a fixed-rate (drift
+// free) timer until asked to stop.  Ticks missed because sampling took too
+// long are skipped and counted as missed.
+static void *
+rb_hps_rec_thread(void * vp)
+{
+  rb_hps_rec_t * p = (rb_hps_rec_t *)vp;
+  long long period = (long long)(1e9 / p->hdr->rate);
+  long long behind;
+  struct timespec next, now;
+
+  if(period < 1)
+    period = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  pthread_mutex_lock(&p->mutex);
+  while(!p->stop) {
+    pthread_mutex_unlock(&p->mutex);
+
+    rb_hps_rec_sample(p, period / 1e9);
+
+    rb_hps_timespec_add_ns(&next, period);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    behind = rb_hps_timespec_diff_ns(&now, &next);
+    if(behind >= 0) {
+      p->hdr->missed += behind / period + 1;
+      rb_hps_timespec_add_ns(&next, (behind / period + 1) * period);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    while(!p->stop &&
+        pthread_cond_timedwait(&p->cond, &p->mutex, &next) != ETIMEDOUT);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return NULL;
+}
+
+/*
+ * call-seq:
+ *   Recorder.new(status, keys, path=nil, capacity: 65536, rate: 100.0)
+ *     -> Recorder
+ *
+ * Creates a Recorder that records the values of +keys+ (an Array of Key
+ * objects, Symbols, or Strings) of +status+ (a Status object) +rate+ times per
+ * second into a ring buffer of +capacity+ records once #start is called.  If
+ * +path+ is given, the ring buffer is a file of that name (which is created
+ * or truncated) that is memory mapped, otherwise it is anonymous memory.
+ * Values are recorded as doubles (i.e. as by Status#hgetr8).
+ */
+VALUE rb_hps_rec_init(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vstatus, vkeys, vpath, vopts, vkey;
+  VALUE opts[2] = {Qundef, Qundef};
+  ID kw[2];
+  rb_hps_rec_t * p;
+  rb_hps_rec_header_t * hdr;
+  rb_hps_key_t tmp;
+  hashpipe_status_t * s;
+  long capacity = RB_HPS_REC_DEFAULT_CAPACITY;
+  double rate = RB_HPS_REC_DEFAULT_RATE;
+  size_t record_size, data_offset;
+  char * keybuf;
+  int i, nkeys;
+
+  rb_scan_args(argc, argv, "21:", &vstatus, &vkeys, &vpath, &vopts);
+
+  if(!rb_obj_is_kind_of(vstatus, cStatus))
+    rb_raise(rb_eTypeError, "status must be a Hashpipe::Status");
+  Data_Get_HPStruct_Ensure_Attached(vstatus, s);
+
+  Check_Type(vkeys, T_ARRAY);
+  nkeys = (int)RARRAY_LEN(vkeys);
+  if(nkeys < 1)
+    rb_raise(rb_eArgError, "no keys to record");
+
+  if(!NIL_P(vopts)) {
+    kw[0] = rb_intern("capacity");
+    kw[1] = rb_intern("rate");
+    rb_get_kwargs(vopts, kw, 0, 2, opts);
+  }
+  if(opts[0] != Qundef && !NIL_P(opts[0]))
+    capacity = NUM2LONG(opts[0]);
+  if(opts[1] != Qundef && !NIL_P(opts[1]))
+    rate = NUM2DBL(opts[1]);
+  if(capacity < 1)
+    rb_raise(rb_eArgError, "capacity must be positive");
+  if(!(rate > 0))
+    rb_raise(rb_eArgError, "rate must be positive");
+
+  Data_Get_HPRec(self, p);
+  if(p->k)
+    rb_raise(rb_eRuntimeError, "already initialized");
+
+  p->status = vstatus;
+  rb_hps_att_add_user(RB_HPS_OBJ(s)->att, &p->hps);
+  p->k = ALLOC_N(rb_hps_key_t, nkeys);
+  p->offsets = ALLOC_N(long, nkeys);
+  p->keys = rb_ary_new_capa(nkeys);
+  for(i = 0; i < nkeys; i++) {
+    p->k[i] = *rb_hps_get_key(rb_ary_entry(vkeys, i), &tmp);
+    p->offsets[i] = -1;
+    vkey = rb_obj_freeze(rb_str_new(p->k[i].key, p->k[i].len));
+    rb_ary_push(p->keys, vkey);
+  }
+  rb_obj_freeze(p->keys);
+  p->nkeys = nkeys;
+
+  // Keys padded to 8 characters follow the header, then (8 byte aligned) the
+  // records.
+  record_size = sizeof(int64_t) + nkeys * sizeof(double);
+  data_offset = (sizeof(rb_hps_rec_header_t) + 8 * nkeys + 7) & ~(size_t)7;
+  p->map_size = data_offset + capacity * record_size;
+
+  if(!NIL_P(vpath)) {
+    FilePathValue(vpath);
+    p->path = rb_str_new_frozen(vpath);
+    p->fd = open(RSTRING_PTR(vpath), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(p->fd < 0)
+      rb_sys_fail(RSTRING_PTR(vpath));
+    if(ftruncate(p->fd, p->map_size))
+      rb_sys_fail(RSTRING_PTR(vpath));
+    hdr = mmap(NULL, p->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, p->fd, 0);
+  } else {
+    hdr = mmap(NULL, p->map_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  }
+  if(hdr == MAP_FAILED)
+    rb_sys_fail("mmap");
+  p->hdr = hdr;
+
+  memset(hdr, 0, data_offset);
+  memcpy(hdr->magic, RB_HPS_REC_MAGIC, sizeof(hdr->magic));
+  hdr->version = RB_HPS_REC_VERSION;
+  hdr->nkeys = nkeys;
+  hdr->capacity = capacity;
+  hdr->record_size = record_size;
+  hdr->data_offset = data_offset;
+  hdr->rate = rate;
+  keybuf = (char *)(hdr + 1);
+  memset(keybuf, ' ', 8 * nkeys);
+  for(i = 0; i < nkeys; i++)
+    memcpy(keybuf + 8*i, p->k[i].key, p->k[i].len);
+
+  return self;
+}
+
+/*
+ * call-seq: start -> self
+ *
+ * Starts the sampling thread (if not already running).  Sampling continues
+ * (appending to any records already recorded) until #stop is called or the
+ * Recorder is garbage collected.  The Recorder holds its own reference to
+ * the status buffer's attachment, so recording is not affected by detaching
+ * the Status object.  In a child process that inherited a running Recorder
+ * over fork, the Recorder is not running (the sampling thread exists only in
+ * the parent) but may be started again.
+ */
+VALUE rb_hps_rec_start(VALUE self)
+{
+  rb_hps_rec_t * p;
+
+  Data_Get_HPRec(self, p);
+  if(!p->hdr)
+    rb_raise(rb_eRuntimeError, "not initialized");
+  if(!p->hps.s.buf)
+    rb_raise(rb_eRuntimeError, "not attached");
+
+  rb_hps_rec_check_fork(p);
+  if(!p->running) {
+    p->stop = 0;
+    if(pthread_create(&p->thread, NULL, rb_hps_rec_thread, p))
+      rb_raise(rb_eRuntimeError, "could not start recorder thread");
+    p->pid = getpid();
+    p->running = 1;
   }
-  Data_Get_HPStruct_Ensure_Attached(self, s);
-  rc = hputs(s->buf, key, val);
-  if(save) key[8] = save;
-  if(rc)
-    // Currently, the only error return is if header length is exceeded
-    rb_raise(rb_eRuntimeError, "header length exceeded");
 
   return self;
 }
 
+/*
+ * call-seq: stop -> self
+ *
+ * Stops the sampling thread (if running) and waits for it to exit.  The
+ * records remain available (and, if backed by a file, are flushed to it).
+ */
+VALUE rb_hps_rec_stop(VALUE self)
+{
+  rb_hps_rec_t * p;
+
+  Data_Get_HPRec(self, p);
+  rb_thread_blocking_region(
+      rb_hps_rec_stop_blocking_func, p,
+      RUBY_UBF_PROCESS, NULL);
+
+  if(p->hdr && p->fd >= 0)
+    msync(p->hdr, p->map_size, MS_ASYNC);
+
+  return self;
+}
+
+/*
+ * call-seq: running? -> +true+ or +false+
+ *
+ * Returns true if the sampling thread is running.
+ */
+VALUE rb_hps_rec_running_p(VALUE self)
+{
+  rb_hps_rec_t * p;
+
+  Data_Get_HPRec(self, p);
+  rb_hps_rec_check_fork(p);
+  return p->running ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: keys -> Array
+ *
+ * Returns the (frozen) Array of the recorded keys as Strings.
+ */
+VALUE rb_hps_rec_keys(VALUE self)
+{
+  rb_hps_rec_t * p;
+
+  Data_Get_HPRec(self, p);
+  return p->keys;
+}
+
+/*
+ * call-seq: path -> String or nil
+ *
+ * Returns the path of the file backing the ring buffer or +nil+ if the ring
+ * buffer is anonymous memory.
+ */
+VALUE rb_hps_rec_path(VALUE self)
+{
+  rb_hps_rec_t * p;
+
+  Data_Get_HPRec(self, p);
+  return p->path;
+}
+
+// Defines a Recorder method returning header field name via conv.
+#define REC_HEADER_METHOD(name, conv) \
+  VALUE rb_hps_rec_##name(VALUE self) \
+  { \
+    rb_hps_rec_t * p; \
+    Data_Get_HPRec(self, p); \
+    if(!p->hdr) \
+      rb_raise(rb_eRuntimeError, "not initialized"); \
+    return conv(p->hdr->name); \
+  }
+
+/*
+ * call-seq: capacity -> Integer
+ *
+ * Returns the number of records that the ring buffer holds.
+ */
+REC_HEADER_METHOD(capacity, ULL2NUM)
+
+/*
+ * call-seq: rate -> Float
+ *
+ * Returns the sampling rate in samples per second.
+ */
+REC_HEADER_METHOD(rate, DBL2NUM)
+
+/*
+ * call-seq: head -> Integer
+ *
+ * Returns the number of records written so far, which is also the number of
+ * the next record to be written.
+ */
+REC_HEADER_METHOD(head, ULL2NUM)
+
+/*
+ * call-seq: missed -> Integer
+ *
+ * Returns the number of samples missed because the sampling thread fell
+ * behind or could not lock the status buffer within one sampling period.
+ */
+REC_HEADER_METHOD(missed, ULL2NUM)
+
+/*
+ * call-seq: records(from=nil, to=nil) -> Array
+ *
+ * Returns the records numbered +from+ (inclusive) through +to+ (exclusive,
+ * defaulting to #head) that are still in the ring buffer as an Array of
+ * [time, values] pairs, where +time+ is a Time and +values+ an Array of
+ * Floats (NaN for missing values) in the same order as #keys.  If +from+ is
+ * +nil+, all records still in the ring buffer are returned.  Records that are
+ * overwritten while being read are omitted.  This can be called while
+ * recording, e.g. to stream records by passing the previous +to+ (or #head)
+ * as +from+.
+ */
+VALUE rb_hps_rec_records(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vfrom, vto, vrecs, vvals;
+  rb_hps_rec_t * p;
+  rb_hps_rec_header_t * hdr;
+  uint64_t head, from, to, n, oldest;
+  const char * rec;
+  int64_t ns;
+  double d;
+  int i;
+
+  rb_scan_args(argc, argv, "02", &vfrom, &vto);
+
+  Data_Get_HPRec(self, p);
+  hdr = p->hdr;
+  if(!hdr)
+    rb_raise(rb_eRuntimeError, "not initialized");
+
+  head = hdr->head;
+  __sync_synchronize();
+  to = NIL_P(vto) ? head : NUM2ULL(vto);
+  if(to > head)
+    to = head;
+  oldest = head > hdr->capacity ? head - hdr->capacity : 0;
+  from = NIL_P(vfrom) ? oldest : NUM2ULL(vfrom);
+  if(from < oldest)
+    from = oldest;
+
+  vrecs = rb_ary_new_capa(from < to ? (long)(to - from) : 0);
+  for(n = from; n < to; n++) {
+    rec = RB_HPS_REC_AT(p, n % hdr->capacity);
+    memcpy(&ns, rec, sizeof(ns));
+    vvals = rb_ary_new_capa(p->nkeys);
+    for(i = 0; i < p->nkeys; i++) {
+      memcpy(&d, rec + sizeof(int64_t) + i * sizeof(double), sizeof(d));
+      rb_ary_push(vvals, DBL2NUM(d));
+    }
+    rb_ary_push(vrecs, rb_assoc_new(
+          rb_time_nano_new(ns / 1000000000LL, ns % 1000000000LL), vvals));
+  }
+
+  // Drop records that the sampling thread may have overwritten meanwhile
+  // (including the one it may be writing if running)
+  __sync_synchronize();
+  head = hdr->head + (p->running ? 1 : 0);
+  if(head > from + hdr->capacity) {
+    n = head - hdr->capacity - from;
+    if(n > (uint64_t)RARRAY_LEN(vrecs))
+      n = RARRAY_LEN(vrecs);
+    if(n > 0)
+      rb_ary_replace(vrecs, rb_ary_subseq(vrecs, n, RARRAY_LEN(vrecs) - n));
+  }
+
+  return vrecs;
+}
+
 #define HGET_METHOD(klass, typecode) \
   rb_define_method(klass, "hget"#typecode, rb_hps_hget##typecode, 1);
 
@@ -434,7 +3520,7 @@ VALUE rb_hps_hputs(VALUE self, VALUE vkey, VALUE vval)
 void Init_hashpipe()
 {
   VALUE mHashpipe;
-  VALUE cStatus;
+  VALUE cStatusSet;
 
   mHashpipe = rb_define_module("Hashpipe");
   cStatus = rb_define_class_under(mHashpipe, "Status", rb_cObject);
@@ -445,17 +3531,35 @@ void Init_hashpipe()
 
   rb_define_alloc_func(cStatus, rb_hps_alloc);
   rb_define_singleton_method(cStatus, "exists?", rb_hps_exists, 1);
+  rb_define_singleton_method(cStatus, "after_fork", rb_hps_after_fork, 0);
   rb_define_method(cStatus, "initialize", rb_hps_init, -1);
   rb_define_method(cStatus, "attach", rb_hps_attach, -1);
   rb_define_method(cStatus, "detach", rb_hps_detach, 0);
   rb_define_method(cStatus, "attached?", rb_hps_attached_p, 0);
   rb_define_method(cStatus, "instance_id", rb_hps_instance_id, 0);
   rb_define_method(cStatus, "unlock", rb_hps_unlock, 0);
-  rb_define_method(cStatus, "lock", rb_hps_lock, 0);
+  rb_define_method(cStatus, "lock", rb_hps_lock, -1);
+  rb_define_method(cStatus, "try_lock", rb_hps_try_lock, 0);
+  rb_define_method(cStatus, "lock_stats_enabled=",
+      rb_hps_set_lock_stats_enabled, 1);
+  rb_define_method(cStatus, "lock_stats_enabled?",
+      rb_hps_lock_stats_enabled_p, 0);
+  rb_define_method(cStatus, "lock_stats", rb_hps_lock_stats, 0);
+  rb_define_method(cStatus, "reset_lock_stats", rb_hps_reset_lock_stats, 0);
   rb_define_method(cStatus, "clear!", rb_hps_clear_bang, 0);
   rb_define_method(cStatus, "delete", rb_hps_delete, 1);
   rb_define_method(cStatus, "buf", rb_hps_buf, 0);
+  rb_define_method(cStatus, "view", rb_hps_view, 0);
   rb_define_method(cStatus, "length", rb_hps_length, 0);
+  rb_define_method(cStatus, "to_hash", rb_hps_to_hash, 0);
+  rb_define_method(cStatus, "diff", rb_hps_diff, 1);
+  rb_define_method(cStatus, "checksum", rb_hps_checksum_m, 0);
+  rb_define_method(cStatus, "changed_since?", rb_hps_changed_since_p, 1);
+  rb_define_method(cStatus, "hget_many", rb_hps_hget_many, -1);
+  rb_define_method(cStatus, "fetch_numeric", rb_hps_fetch_numeric, -1);
+  rb_define_method(cStatus, "key_index=", rb_hps_set_key_index, 1);
+  rb_define_method(cStatus, "key_index?", rb_hps_key_index_p, 0);
+  rb_define_method(cStatus, "hput_many", rb_hps_hput_many, -1);
 
   // hget methods
   HGET_METHOD(cStatus, i4);
@@ -466,6 +3570,64 @@ void Init_hashpipe()
   HGET_METHOD(cStatus, r8);
   HGET_METHOD(cStatus, s);
 
+  rb_define_method(cStatus, "snapshot", rb_hps_snapshot, -1);
+  rb_define_method(cStatus, "wait_for_change", rb_hps_wait_for_change_m, -1);
+
+  cKey = rb_define_class_under(mHashpipe, "Key", rb_cObject);
+  rb_define_alloc_func(cKey, rb_hps_key_alloc);
+  rb_define_method(cKey, "initialize", rb_hps_key_init_m, 1);
+  rb_define_method(cKey, "to_s", rb_hps_key_to_s, 0);
+  rb_define_method(cKey, "==", rb_hps_key_eq, 1);
+  rb_define_method(cKey, "eql?", rb_hps_key_eq, 1);
+  rb_define_method(cKey, "hash", rb_hps_key_hash, 0);
+
+  cSnapshot = rb_define_class_under(mHashpipe, "Snapshot", rb_cObject);
+  rb_undef_alloc_func(cSnapshot);
+  rb_define_method(cSnapshot, "instance_id", rb_hps_instance_id, 0);
+  rb_define_method(cSnapshot, "time", rb_hps_snapshot_time, 0);
+  rb_define_method(cSnapshot, "buf", rb_hps_buf, 0);
+  rb_define_method(cSnapshot, "length", rb_hps_length, 0);
+  rb_define_method(cSnapshot, "to_hash", rb_hps_snapshot_to_hash, 0);
+  rb_define_method(cSnapshot, "diff", rb_hps_snapshot_diff, 1);
+  rb_define_method(cSnapshot, "checksum", rb_hps_checksum_m, 0);
+  rb_define_method(cSnapshot, "changed_since?", rb_hps_changed_since_p, 1);
+  rb_define_method(cSnapshot, "hget_many", rb_hps_hget_many, -1);
+  rb_define_method(cSnapshot, "fetch_numeric", rb_hps_fetch_numeric, -1);
+  rb_define_method(cSnapshot, "key_index=", rb_hps_set_key_index, 1);
+  rb_define_method(cSnapshot, "key_index?", rb_hps_key_index_p, 0);
+
+  cStatusSet = rb_define_class_under(mHashpipe, "StatusSet", rb_cObject);
+  rb_define_alloc_func(cStatusSet, rb_hps_set_alloc);
+  rb_define_method(cStatusSet, "initialize", rb_hps_set_init, -1);
+  rb_define_method(cStatusSet, "statuses", rb_hps_set_statuses, 0);
+  rb_define_method(cStatusSet, "max_threads", rb_hps_set_max_threads, 0);
+  rb_define_method(cStatusSet, "max_threads=", rb_hps_set_set_max_threads, 1);
+  rb_define_method(cStatusSet, "snapshot", rb_hps_set_snapshot, -1);
+  rb_define_method(cStatusSet, "wait_for_change",
+      rb_hps_set_wait_for_change, -1);
+
+  cRecorder = rb_define_class_under(mHashpipe, "Recorder", rb_cObject);
+  rb_define_alloc_func(cRecorder, rb_hps_rec_alloc);
+  rb_define_method(cRecorder, "initialize", rb_hps_rec_init, -1);
+  rb_define_method(cRecorder, "start", rb_hps_rec_start, 0);
+  rb_define_method(cRecorder, "stop", rb_hps_rec_stop, 0);
+  rb_define_method(cRecorder, "running?", rb_hps_rec_running_p, 0);
+  rb_define_method(cRecorder, "keys", rb_hps_rec_keys, 0);
+  rb_define_method(cRecorder, "path", rb_hps_rec_path, 0);
+  rb_define_method(cRecorder, "capacity", rb_hps_rec_capacity, 0);
+  rb_define_method(cRecorder, "rate", rb_hps_rec_rate, 0);
+  rb_define_method(cRecorder, "head", rb_hps_rec_head, 0);
+  rb_define_method(cRecorder, "missed", rb_hps_rec_missed, 0);
+  rb_define_method(cRecorder, "records", rb_hps_rec_records, -1);
+
+  HGET_METHOD(cSnapshot, i4);
+  HGET_METHOD(cSnapshot, i8);
+  HGET_METHOD(cSnapshot, u4);
+  HGET_METHOD(cSnapshot, u8);
+  HGET_METHOD(cSnapshot, r4);
+  HGET_METHOD(cSnapshot, r8);
+  HGET_METHOD(cSnapshot, s);
+
   // hput methods
   HPUT_METHOD(cStatus, i4);
   HPUT_METHOD(cStatus, i8);
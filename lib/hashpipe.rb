@@ -6,6 +6,7 @@ require hashpipe_shared_lib
 require 'hashpipe_gem' if false # Fake out RDoc
 
 require 'hashpipe/version'
+require 'hashpipe/recorder'
 
 module Hashpipe
   class Status
@@ -13,33 +14,111 @@ module Hashpipe
     alias :[]  :hgets
     alias :[]= :hputs
 
-    # Return current buffer contents as a Hash
-    def to_hash
-      # Get buffer contents as a String
-      s = lock {buf} rescue ''
-      # Split into RECORD_SIZE character lines
-      lines = s.scan(/.{#{RECORD_SIZE}}/o)
-      # Skip END record
-      lines.pop if lines[-1].start_with?('END ')
-
-      # Parse lines into key and value
-      h = {}
-      lines.each do |l|
-        key, value = l.split('=', 2)
-        value ||= '' # In case no '='
-        key.strip!
-        value.strip!
-        # If value is enclosed in single quotes, remove them and strip spaces
-        value = value[1..-2].strip if /^'.*'$/ =~ value
-        h[key] = value
-      end
-      h
-    end # to_hash
-
     # Return a more user-friendly string than the default.
     def inspect
       "#<#{self.class} instance_id=#{instance_id}>"
     end
 
+    # Returns the values of +keys+ (see #fetch_numeric) as a Numo::DFloat.
+    # Requires the numo-narray gem.
+    def fetch_narray(keys)
+      require 'numo/narray'
+      Numo::DFloat.from_binary(fetch_numeric(keys))
+    end
+
   end # class Status
+
+  class Snapshot
+
+    alias :[]  :hgets
+
+    # Return a more user-friendly string than the default.
+    def inspect
+      "#<#{self.class} instance_id=#{instance_id} time=#{time}>"
+    end
+
+    # Returns the values of +keys+ (see #fetch_numeric) as a Numo::DFloat.
+    # Requires the numo-narray gem.
+    def fetch_narray(keys)
+      require 'numo/narray'
+      Numo::DFloat.from_binary(fetch_numeric(keys))
+    end
+
+  end # class Snapshot
+
+  class StatusSet
+    include Enumerable
+
+    # Yields each Status object in the set.
+    def each(&block)
+      statuses.each(&block)
+    end
+
+    # Returns the instance ids of the Status objects in the set.
+    def instance_ids
+      statuses.map(&:instance_id)
+    end
+
+    def inspect
+      "#<#{self.class} instance_ids=#{instance_ids}>"
+    end
+  end # class StatusSet
+
+  class Recorder
+    # Streams records as they are recorded, starting with record number
+    # +from+ (defaulting to the next record to be recorded), by yielding the
+    # time and values of each record.  Checks for new records every
+    # +interval+ seconds.  Returns (the number of the next record to stream)
+    # when the Recorder is no longer running.
+    def stream(from=nil, interval=0.1)
+      from ||= head
+      loop do
+        running = running?
+        to = head
+        records(from, to).each {|time, values| yield time, values}
+        from = to
+        return from unless running
+        sleep interval
+      end
+    end
+
+    # Writes the records numbered +from+ (or all records still in the ring
+    # buffer if +from+ is nil) to +io+ as text.  See RecorderFile.dump.
+    def dump(io=$stdout, from=nil)
+      RecorderFile.dump(io, keys, records(from))
+    end
+
+    # Return a more user-friendly string than the default.
+    def inspect
+      "#<#{self.class} keys=#{keys} rate=#{rate} head=#{head}" \
+        "#{path ? " path=#{path}" : ''}>"
+    end
+  end # class Recorder
+
+  # Reattaches the pooled status buffer attachments (see Status.after_fork)
+  # in child processes created by Process.fork (and Kernel#fork, etc.) or
+  # Process.daemon.
+  module ForkHooks
+    def _fork
+      pid = super
+      Status.after_fork if pid == 0
+      pid
+    end
+
+    def daemon(*args)
+      rc = super
+      Status.after_fork
+      rc
+    end
+  end # module ForkHooks
+
+  # Process._fork is only available (and called by all forking methods)
+  # since Ruby 3.1.
+  Process.singleton_class.prepend(ForkHooks) if Process.respond_to?(:_fork)
+
+  class Key
+    def inspect
+      "#<#{self.class} #{to_s}>"
+    end
+  end # class Key
 end # module Hashpipe
@@ -0,0 +1,55 @@
+module Hashpipe
+  # Module containing methods for drawing "cells" on a Curses window.  Cells
+  # are given as a Hash mapping [row, col] to [string, color], where +color+
+  # is a color pair number (or nil for the default color pair, 0).  Only cells
+  # that changed since the previous draw are redrawn, which avoids the flicker
+  # of clearing and redrawing the whole window.
+  module CursesCells
+    # Returns +cells+ with each string clipped so that it does not overwrite
+    # the next cell on its row or the right border of +win+.
+    def clip_cells(win, cells)
+      clipped = {}
+      positions = cells.keys.sort
+      positions.each_with_index do |pos, i|
+        row, col = pos
+        nextpos = positions[i+1]
+        limit = (nextpos && nextpos[0] == row) ? nextpos[1] : win.maxx - 1
+        string, color = cells[pos]
+        clipped[pos] = [string[0, limit - col], color] if limit > col
+      end
+      clipped
+    end
+    module_function :clip_cells
+
+    # Draws the (clipped) +cells+ on +win+, but only those that differ from
+    # +prev_cells+ (the cells drawn last time).  Cells of +prev_cells+ that
+    # are no longer present are blanked, as is any leftover part of a cell
+    # whose string got shorter.  Returns true if anything was drawn.
+    def draw_cells(win, cells, prev_cells)
+      drawn = false
+
+      # Blank cells that went away
+      (prev_cells.keys - cells.keys).each do |row, col|
+        win.setpos(row, col)
+        win.addstr(' ' * prev_cells[[row, col]][0].length)
+        drawn = true
+      end
+
+      # Draw changed cells
+      cells.each do |pos, (string, color)|
+        next if prev_cells[pos] == [string, color]
+        win.setpos(*pos)
+        win.color_set(color) if color
+        win.addstr(string)
+        win.color_set(0) if color && color != 0
+        # Blank the rest of a previously longer string
+        pad = prev_cells[pos] ? prev_cells[pos][0].length - string.length : 0
+        win.addstr(' ' * pad) if pad > 0
+        drawn = true
+      end
+
+      drawn
+    end
+    module_function :draw_cells
+  end
+end
@@ -7,11 +7,37 @@ module Hashpipe
     end
     module_function :gw_inst_type
 
+    # Parses +key+, a key or channel name as returned by gw_inst_type, into
+    # [gwname, instance_id, type, domain] (all Strings, with nil for a missing
+    # gwname or instance_id).  Returns nil if +key+ is not of that form.
+    def parse_gw_inst_type(key)
+      m = %r{\A([^:/]*)://([^/]*)/(?:([^/]+)/)?([^/]+)\z}.match(key.to_s)
+      return nil unless m
+      gwname = m[2].empty? ? nil : m[2]
+      [gwname, m[3], m[4], m[1]]
+    end
+    module_function :parse_gw_inst_type
+
+    # Parses +key+, a status key (or statusbin key), into [gwname,
+    # instance_id, domain].  Returns nil if +key+ is not a status key.
+    def parse_status_key(key)
+      gwname, instance_id, type, domain = parse_gw_inst_type(key)
+      return nil unless gwname && instance_id
+      return nil unless type == 'status' || type == 'statusbin'
+      [gwname, instance_id, domain]
+    end
+    module_function :parse_status_key
+
     def status_key(gwname, instance_id, domain=:hashpipe)
       gw_inst_type(gwname, instance_id, :status, domain)
     end
     module_function :status_key
 
+    def statusbin_key(gwname, instance_id, domain=:hashpipe)
+      gw_inst_type(gwname, instance_id, :statusbin, domain)
+    end
+    module_function :statusbin_key
+
     def update_channel(gwname, instance_id, domain=:hashpipe)
       gw_inst_type(gwname, instance_id, :update, domain)
     end
@@ -39,5 +65,39 @@ module Hashpipe
       #'hashpipe:///gateway'
     end
     module_function :bcast_gateway_channel
+
+    # Number of hash slots in a Redis Cluster.
+    KEY_SLOTS = 16384
+
+    # Lookup table for CRC16 (XMODEM variant) as used by Redis Cluster.
+    CRC16_TABLE = (0...256).map do |i|
+      crc = i << 8
+      8.times {crc = (crc & 0x8000) != 0 ? ((crc << 1) ^ 0x1021) : (crc << 1)}
+      crc & 0xffff
+    end.freeze
+
+    # Returns the Redis Cluster hash slot (0 to KEY_SLOTS-1) of +key+.  As
+    # with Redis Cluster, if +key+ contains a non-empty "{...}" hash tag, only
+    # the hash tag is hashed.
+    def key_slot(key)
+      key = key.to_s
+      if (s = key.index('{')) && (e = key.index('}', s+1)) && e > s+1
+        key = key[s+1...e]
+      end
+      crc = 0
+      key.each_byte do |b|
+        crc = ((crc << 8) & 0xffff) ^ CRC16_TABLE[((crc >> 8) ^ b) & 0xff]
+      end
+      crc % KEY_SLOTS
+    end
+    module_function :key_slot
+
+    # Returns the shard (0 to nshards-1) for +key+ when spreading keys over
+    # +nshards+ Redis connections.  Keys in the same hash slot always map to
+    # the same shard.
+    def key_shard(key, nshards)
+      key_slot(key) % nshards
+    end
+    module_function :key_shard
   end
 end
@@ -0,0 +1,310 @@
+require 'zlib'
+require 'hashpipe'
+
+module Hashpipe
+  # A MetricsRenderer renders the body of the Prometheus exporter's response
+  # for hashpipe_redis_gateway.rb.  All label strings are rendered once, when
+  # it is created.  The configured fields are fetched with Status#hget_many
+  # and the rendered lines of each instance are cached (both as text and as
+  # deflated data) until its status buffer's checksum changes, so scrapes of
+  # unchanged status buffers just concatenate cached strings.  Each section is
+  # deflated independently (with a full flush, so it does not depend on the
+  # data before it) and a gzip'd body is a gzip header, the concatenated
+  # deflated sections, an empty final block, and the combined CRC and length
+  # of the sections.
+  class MetricsRenderer
+    # Lock statistics of the gateway's own use of the status buffers
+    LOCK_STATS = [
+      ['lock_acquisitions_total', :count, 'counter',
+       'Number of status buffer lock acquisitions by the gateway'],
+      ['lock_wait_seconds_total', :wait_total, 'counter',
+       'Total seconds the gateway waited for status buffer locks'],
+      ['lock_wait_seconds_max', :wait_max, 'gauge',
+       'Maximum seconds the gateway waited for a status buffer lock'],
+      ['lock_hold_seconds_total', :hold_total, 'counter',
+       'Total seconds the gateway held status buffer locks'],
+      ['lock_hold_seconds_max', :hold_max, 'gauge',
+       'Maximum seconds the gateway held a status buffer lock']
+    ]
+
+    # Per-instance state
+    Instance = Struct.new(:status, :labels, :field_prefixes,
+                          :checksum, :text, :deflated,
+                          :derived_labels, :series)
+
+    # Per-instance state of a derived (counter, rate, or histogram) field: last
+    # observed value and time, last rate, and histogram bucket counts, sum, and
+    # count.
+    Series = Struct.new(:value, :time, :rate, :buckets, :sum, :count)
+
+    # A deflated section: raw deflate data, CRC-32 and length of the text
+    Deflated = Struct.new(:data, :crc, :length)
+
+    # gzip header (deflate, no name, no mtime, unknown OS) and empty final block
+    GZIP_HEADER = [0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255].pack('C*').freeze
+    FINAL_BLOCK = [3, 0].pack('C*').freeze
+
+    # Returns a Deflated for +text+.
+    def self.deflate(text)
+      z = Zlib::Deflate.new(Zlib::DEFAULT_COMPRESSION, -Zlib::MAX_WBITS)
+      data = z.deflate(text, Zlib::FULL_FLUSH)
+      z.close
+      Deflated.new(data, Zlib.crc32(text), text.bytesize)
+    end
+
+    # Returns a gzip stream of the concatenation of the texts of the Deflated
+    # objects in +sections+.
+    def self.gzip(sections)
+      crc = sections.inject(0) {|c, d| Zlib.crc32_combine(c, d.crc, d.length)}
+      length = sections.sum(&:length)
+      GZIP_HEADER + sections.map(&:data).join + FINAL_BLOCK +
+        [crc, length & 0xffffffff].pack('VV')
+    end
+
+    # Returns a Key for +name+ if it is a valid key name or else +name+.
+    def self.key(name)
+      Hashpipe::Key.new(name) rescue name
+    end
+
+    # Creates a MetricsRenderer for +conf+ (the gateway's "prometheus" config,
+    # with "name", "help", and "fields") and +statuses+ (Status objects).
+    # +opts+ may contain :domain and :gwname (for labels), :lock_timeout (in
+    # seconds, default 1.0), and :pipeline_stats, a Proc returning a Hash with
+    # the gateway's :snapshot_overruns and :writer_overruns counts.
+    def initialize(conf, statuses, opts={})
+      @opts = {:domain => 'hashpipe', :lock_timeout => 1.0}.merge(opts)
+      @metric = metric = conf['name']
+      all_fields = conf['fields'] || []
+      # Counter fields are not exported as gauges
+      @fields = all_fields.reject {|f| f['type'] == 'counter'}
+      @field_keys = @fields.map {|f| MetricsRenderer.key(f['name'])}
+
+      # Fields with values derived from successive snapshots.  These are
+      # copies, with sorted Float histogram bucket bounds, so that +conf+ is
+      # not modified.
+      @derived = all_fields.select do |f|
+        !f['string'] && (f['type'] == 'counter' || f['rate'] || f['histogram'])
+      end
+      @derived.map! do |f|
+        f = f.dup
+        f['histogram'] = f['histogram'].map(&:to_f).sort if f['histogram']
+        f
+      end
+      @derived_keys = @derived.map {|f| MetricsRenderer.key(f['name'])}
+
+      @header = ''
+      unless @fields.empty?
+        @header = "# HELP #{metric} #{conf['help']}\n" +
+                  "# TYPE #{metric} gauge\n"
+      end
+      @header_deflated = MetricsRenderer.deflate(@header)
+
+      @gw_labels = "{domain=\"#{@opts[:domain]}\", " +
+                   "gateway=\"#{@opts[:gwname]}\"}"
+      @instances = statuses.map do |sb|
+        labels = "domain=\"#{@opts[:domain]}\", " +
+                 "hpinstance=\"#{@opts[:gwname]}/#{sb.instance_id}\""
+        prefixes = @fields.map do |f|
+          "#{metric}{#{labels}, name=\"#{f['name']}\""
+        end
+        derived_labels = @derived.map {|f| "#{labels}, name=\"#{f['name']}\""}
+        series = @derived.map do |f|
+          Series.new(nil, nil, nil, f['histogram'] && [0]*f['histogram'].length,
+                     0.0, 0)
+        end
+        # Text is empty until first rendered (and stays empty if there are no
+        # gauge fields)
+        Instance.new(sb, "{#{labels}}", prefixes, nil, '', nil,
+                     derived_labels, series)
+      end
+      @instances_by_id = {}
+      @instances.each {|inst| @instances_by_id[inst.status.instance_id] = inst}
+
+      @derived_help = [
+        ['total', 'counter', "#{conf['help']} (counter)",
+         @derived.any? {|f| f['type'] == 'counter'}],
+        ['rate', 'gauge', "#{conf['help']} (per second rate)",
+         @derived.any? {|f| f['rate']}],
+        ['histogram', 'histogram', "#{conf['help']} (histogram)",
+         @derived.any? {|f| f['histogram']}]
+      ].map do |suffix, type, help, used|
+        used ? "# HELP #{metric}_#{suffix} #{help}\n" +
+               "# TYPE #{metric}_#{suffix} #{type}\n" : nil
+      end
+
+      @lock_stats_help = LOCK_STATS.map do |suffix, _, type, help|
+        "# HELP #{metric}_#{suffix} #{help}\n" +
+        "# TYPE #{metric}_#{suffix} #{type}\n"
+      end
+
+      # Guards the caches in case render is called from more than one thread
+      @mutex = Mutex.new
+    end
+
+    # Updates derived fields from +snapshots+ (an Array of Snapshot objects,
+    # possibly with nil elements).  Called for every set of snapshots taken by
+    # the gateway.
+    def observe(snapshots)
+      return if @derived.empty?
+      @mutex.synchronize do
+        snapshots.each do |sb|
+          next unless sb && (inst = @instances_by_id[sb.instance_id])
+          t = sb.time.to_f
+          values = sb.hget_many(@derived_keys, :r8)
+          @derived.each_with_index do |field, i|
+            value = values[i] or next
+            series = inst.series[i]
+            if series.time && t > series.time
+              delta = value - series.value
+              # A decrease is a counter reset
+              delta = value if delta < 0
+              series.rate = delta / (t - series.time)
+            end
+            series.value = value
+            series.time = t
+            if (bounds = field['histogram'])
+              observed = field['rate'] ? series.rate : value
+              next unless observed
+              bounds.each_with_index do |le, j|
+                series.buckets[j] += 1 if observed <= le
+              end
+              series.sum += observed
+              series.count += 1
+            end
+          end
+        end
+      end
+    end
+
+    # Returns the response body, gzip'd if +gzip+ is true.
+    def render(gzip=false)
+      start = Time.now
+      @mutex.synchronize do
+        @instances.each {|inst| refresh(inst)} unless @fields.empty?
+        stats = render_derived + render_stats(start)
+        if gzip
+          @instances.each do |inst|
+            inst.deflated ||= MetricsRenderer.deflate(inst.text)
+          end
+          MetricsRenderer.gzip([@header_deflated] +
+                               @instances.map(&:deflated) +
+                               [MetricsRenderer.deflate(stats)])
+        else
+          @header + @instances.map(&:text).join + stats
+        end
+      end
+    end
+
+    private
+
+    # Re-renders the field lines of +inst+ if its status buffer has changed
+    # since they were last rendered.  The (unlocked) checksum is checked first
+    # so that unchanged status buffers are not even locked.  If the status
+    # buffer cannot be locked within opts[:lock_timeout] seconds, the previous
+    # lines are kept.
+    def refresh(inst)
+      return if inst.checksum && inst.status.checksum == inst.checksum
+
+      checksum = values = nil
+      inst.status.lock(timeout: @opts[:lock_timeout]) do |sb|
+        checksum = sb.checksum
+        values = sb.hget_many(@field_keys)
+      end
+      return unless values
+
+      text = ''
+      @fields.each_with_index do |field, i|
+        value = values[i] or next
+        if field['string']
+          text << "#{inst.field_prefixes[i]}, value=\"#{value}\"} 1\n"
+        else
+          text << "#{inst.field_prefixes[i]}} #{value.to_r.to_f}\n"
+        end
+      end
+      inst.checksum = checksum
+      inst.text = text
+      inst.deflated = nil
+    end
+
+    # Returns the rendered lines of the derived fields.
+    def render_derived
+      metric = @metric
+      body = ''
+      return body if @derived.empty?
+
+      total_help, rate_help, histogram_help = @derived_help
+      if total_help
+        body << total_help
+        each_series do |field, labels, series|
+          next unless field['type'] == 'counter' && series.value
+          body << "#{metric}_total{#{labels}} #{series.value}\n"
+        end
+      end
+      if rate_help
+        body << rate_help
+        each_series do |field, labels, series|
+          next unless field['rate'] && series.rate
+          body << "#{metric}_rate{#{labels}} #{series.rate}\n"
+        end
+      end
+      if histogram_help
+        body << histogram_help
+        each_series do |field, labels, series|
+          next unless (bounds = field['histogram'])
+          bounds.each_with_index do |le, j|
+            body << "#{metric}_histogram_bucket{#{labels}, le=\"#{le}\"} " +
+                    "#{series.buckets[j]}\n"
+          end
+          body << "#{metric}_histogram_bucket{#{labels}, le=\"+Inf\"} " +
+                  "#{series.count}\n"
+          body << "#{metric}_histogram_sum{#{labels}} #{series.sum}\n"
+          body << "#{metric}_histogram_count{#{labels}} #{series.count}\n"
+        end
+      end
+      body
+    end
+
+    # Yields each derived field, its labels, and its Series for each instance.
+    def each_series
+      @instances.each do |inst|
+        @derived.each_with_index do |field, i|
+          yield field, inst.derived_labels[i], inst.series[i]
+        end
+      end
+    end
+
+    # Returns the rendered statistics lines (which are not cached since they
+    # change on every update).
+    def render_stats(start)
+      metric = @metric
+      body = ''
+
+      LOCK_STATS.each_with_index do |(suffix, stat, _, _), i|
+        body << @lock_stats_help[i]
+        @instances.each do |inst|
+          stats = inst.status.lock_stats or next
+          body << "#{metric}_#{suffix}#{inst.labels} #{stats[stat]}\n"
+        end
+      end
+
+      # Pipeline statistics of the gateway itself
+      pipeline = @opts[:pipeline_stats] ? @opts[:pipeline_stats].call : {}
+      [
+        ['snapshot_overruns_total', pipeline[:snapshot_overruns] || 0,
+         'Number of snapshot timer ticks missed by the gateway'],
+        ['writer_overruns_total', pipeline[:writer_overruns] || 0,
+         'Number of snapshots replaced before the gateway wrote them to Redis']
+      ].each do |suffix, value, help|
+        body << "# HELP #{metric}_#{suffix} #{help}\n"
+        body << "# TYPE #{metric}_#{suffix} counter\n"
+        body << "#{metric}_#{suffix}#{@gw_labels} #{value}\n"
+      end
+
+      body << "# HELP #{metric}_scrape_duration_seconds " +
+              "Number of seconds to scrape the #{metric} exporter\n"
+      body << "# TYPE #{metric}_scrape_duration_seconds gauge\n"
+      body << "#{metric}_scrape_duration_seconds#{@gw_labels} " +
+              "#{(Time.now-start).to_f}\n"
+    end
+  end # class MetricsRenderer
+end # module Hashpipe
@@ -0,0 +1,80 @@
+module Hashpipe
+  # Module containing methods for reading the ring buffer files written by
+  # Hashpipe::Recorder.  This module does not require the Hashpipe extension,
+  # so recordings can be read (e.g. for post-mortems) on any host.
+  #
+  # A recorder file consists of a 64 byte header, the recorded keys (8 space
+  # padded characters each), and then (at the data offset) the ring buffer of
+  # records:
+  #
+  #   Offset  Size  Contents
+  #        0     8  Magic number "HPRECRD\0"
+  #        8     4  Format version (currently 1)
+  #       12     4  Number of keys (NKEYS)
+  #       16     8  Capacity of the ring buffer (in records)
+  #       24     8  Record size (8 + 8 * NKEYS)
+  #       32     8  Data offset
+  #       40     8  Sampling rate (samples per second, double)
+  #       48     8  Number of records written (HEAD)
+  #       56     8  Number of samples missed
+  #       64   ...  Keys, then records
+  #
+  # All fields are native endian.  Each record is the time of the sample in
+  # nanoseconds since the epoch (int64) followed by one double per key (NaN for
+  # missing or non-numeric values).  Record number N is stored at index
+  # N % capacity; the valid records are numbers max(0, HEAD-capacity) through
+  # HEAD-1.
+  module RecorderFile
+    MAGIC = "HPRECRD\0".b.freeze
+    VERSION = 1
+    HEADER_FORMAT = 'a8LLQQQdQQ'
+    HEADER_SIZE = 64
+
+    # A recording as read by RecorderFile.read.  +records+ is an Array of
+    # [time, values] pairs as returned by Recorder#records.
+    Recording = Struct.new(:keys, :rate, :capacity, :head, :missed, :records)
+
+    # Reads the recorder file +path+ and returns a Recording.  Raises
+    # ArgumentError if +path+ is not a recorder file of a supported version.
+    def read(path)
+      File.open(path, 'rb') do |f|
+        header = f.read(HEADER_SIZE)
+        if header.nil? || header.bytesize < HEADER_SIZE ||
+           header[0, 8] != MAGIC
+          raise ArgumentError, "#{path} is not a recorder file"
+        end
+        _, version, nkeys, capacity, record_size, data_offset, rate, head,
+          missed = header.unpack(HEADER_FORMAT)
+        if version != VERSION
+          raise ArgumentError, "unsupported recorder file version #{version}"
+        end
+        keys = f.read(8 * nkeys).scan(/.{8}/m).map(&:rstrip)
+
+        f.seek(data_offset)
+        data = f.read(capacity * record_size)
+        oldest = head > capacity ? head - capacity : 0
+        format = "qd#{nkeys}"
+        records = (oldest...head).map do |n|
+          ns, *values = data.unpack("@#{(n % capacity) * record_size}#{format}")
+          [Time.at(ns / 1_000_000_000, ns % 1_000_000_000, :nsec), values]
+        end
+
+        Recording.new(keys, rate, capacity, head, missed, records)
+      end
+    end
+    module_function :read
+
+    # Writes +records+ (as returned by Recorder#records) of +keys+ to +io+ as
+    # text, one line per record, preceded by a header line of key names.  Each
+    # line has the time (with nanoseconds) followed by the values.
+    def dump(io, keys, records)
+      io.puts ['# TIME', *keys].join(' ')
+      records.each do |time, values|
+        io.puts [time.strftime('%FT%T.%N'), *values.map {|v| '%.17g' % v}
+                ].join(' ')
+      end
+      io
+    end
+    module_function :dump
+  end
+end
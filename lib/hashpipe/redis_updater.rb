@@ -0,0 +1,103 @@
+require 'hashpipe/keys'
+require 'hashpipe/statusbin'
+
+module Hashpipe
+  # A RedisUpdater writes snapshots of status buffers to Redis for
+  # hashpipe_redis_gateway.rb.  Its behavior is controlled by the Hash +opts+
+  # given to ::new, which is consulted on every update (so changes to it take
+  # effect immediately):
+  #
+  #   :gwname         - Gateway name (for keys and channels)
+  #   :domain         - Domain of keys and channels
+  #   :delay          - Seconds between updates (keys expire after 3 delays)
+  #   :expire         - Whether keys expire
+  #   :skip_unchanged - Whether to skip unchanged status buffers
+  #   :incremental    - Whether to write only changed fields
+  #   :format         - Keys to write: :hash, :bin, or :both
+  class RedisUpdater
+    # For incremental updates, full (i.e. non-incremental) updates are done at
+    # least every INCREMENTAL_RESYNC seconds to recover from keys having
+    # expired or been modified in Redis.
+    INCREMENTAL_RESYNC = 60
+
+    def initialize(opts)
+      @opts = opts
+      # Maps instance id to the checksum of its status buffer as of the last
+      # update
+      @last_checksums = {}
+      # For incremental updates, maps instance id to the contents of its
+      # status buffer (as a Hash) as of the last update and to the time of its
+      # last full update
+      @prev_hashes = {}
+      @last_full_update = {}
+    end
+
+    # Updates redis with contents of +snapshots+ (an Array of Snapshot
+    # objects) and publishes each statusbuf's key on its "update" channel (if
+    # +notify+ is true).  If opts[:skip_unchanged] is true, status buffers that
+    # have not changed since the last update only have their expiration time
+    # refreshed.  If opts[:incremental] is true, only fields that have been
+    # added, changed, or deleted since the last update are written.
+    # opts[:format] selects whether the status key (:hash), the statusbin key
+    # (:bin), or both (:both) are written.
+    def update(redis, snapshots, notify=false)
+      # Pipeline all status buffer updates
+      redis.pipelined do
+        snapshots.each do |sb|
+          iid = sb.instance_id
+          # If requested, skip status buffers whose contents are unchanged
+          # since the last update (other than refreshing the expiration time).
+          checksum = sb.checksum
+          unchanged = @opts[:skip_unchanged] &&
+                      @last_checksums[iid] == checksum
+          @last_checksums[iid] = checksum
+          # Each status buffer update happens in a transaction
+          redis.multi do
+            key = Hashpipe::RedisKeys.status_key(@opts[:gwname], iid,
+                                                 @opts[:domain])
+            # Expire time must be integer, we always round up
+            expire = (3*@opts[:delay]).ceil
+            prev = @prev_hashes[iid]
+            if unchanged || @opts[:format] == :bin
+              # Nothing to do
+            elsif @opts[:incremental] && prev &&
+                  Time.now - @last_full_update[iid] < INCREMENTAL_RESYNC
+              # Only write changes since last update
+              added, changed, deleted = sb.diff(prev)
+              updates = added.merge!(changed)
+              redis.mapped_hmset(key, updates) unless updates.empty?
+              redis.hdel(key, deleted) unless deleted.empty?
+              prev.merge!(updates)
+              deleted.each {|k| prev.delete(k)}
+              unchanged = updates.empty? && deleted.empty?
+            else
+              redis.del(key)
+              sb_hash = sb.to_hash
+              redis.mapped_hmset(key, sb_hash)
+              if @opts[:incremental]
+                @prev_hashes[iid] = sb_hash
+                @last_full_update[iid] = Time.now
+              end
+            end
+            if @opts[:format] != :bin
+              redis.expire(key, expire) if @opts[:expire]
+            end
+            if @opts[:format] != :hash
+              binkey = Hashpipe::RedisKeys.statusbin_key(@opts[:gwname], iid,
+                                                         @opts[:domain])
+              redis.set(binkey, Hashpipe::StatusBin.encode(sb)) unless unchanged
+              redis.expire(binkey, expire) if @opts[:expire]
+              # Subscribers of bin only gateways are notified with the bin key
+              key = binkey if @opts[:format] == :bin
+            end
+            if notify && !unchanged
+              # Publish "updated" method to notify subscribers
+              channel = "#{@opts[:domain]}://#{@opts[:gwname]}/#{iid}/update"
+              redis.publish channel, key
+            end
+          end # redis.multi
+        end # snapshots.each
+      end # redis.pipelined
+    end # def update
+  end # class RedisUpdater
+end # module Hashpipe
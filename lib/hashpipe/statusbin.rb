@@ -0,0 +1,120 @@
+require 'zlib'
+
+module Hashpipe
+  # Module containing methods for encoding and decoding the compact binary
+  # form of a status buffer ("statusbin") that hashpipe_redis_gateway.rb can
+  # store in Redis instead of (or in addition to) a Redis hash.  This module
+  # does not require the Hashpipe extension, so it can be used on hosts that
+  # only read status buffers from Redis.
+  #
+  # A statusbin blob consists of a 24 byte header followed by the payload:
+  #
+  #   Offset  Size  Contents
+  #        0     4  Magic number "HPSB"
+  #        4     1  Format version (currently 1)
+  #        5     1  Payload encoding (ENCODING_RAW or ENCODING_ZLIB)
+  #        6     2  Record size (80), little endian
+  #        8     8  Snapshot time in nanoseconds since the epoch, little endian
+  #       16     8  Status buffer checksum (Snapshot#checksum), little endian
+  #       24   ...  Status buffer records up to and including the END record
+  #
+  # The payload is the raw 80 character records of the status buffer,
+  # compressed with zlib if the encoding is ENCODING_ZLIB.
+  module StatusBin
+    MAGIC = 'HPSB'.b.freeze
+    VERSION = 1
+    ENCODING_RAW  = 0
+    ENCODING_ZLIB = 1
+    RECORD_SIZE = 80
+    HEADER_FORMAT = 'a4CCvQ<Q<'
+    HEADER_SIZE = 24
+
+    # Returns a statusbin blob (a binary String) for +snapshot+, which must
+    # respond to #buf, #time, and #checksum (e.g. a Hashpipe::Snapshot).  The
+    # payload is compressed unless +compress+ is false.
+    def encode(snapshot, compress=true)
+      records = snapshot.buf
+      t = snapshot.time
+      nsec = t.to_i * 1_000_000_000 + t.nsec
+      if compress
+        encoding = ENCODING_ZLIB
+        records = Zlib::Deflate.deflate(records)
+      else
+        encoding = ENCODING_RAW
+      end
+      [MAGIC, VERSION, encoding, RECORD_SIZE, nsec, snapshot.checksum
+      ].pack(HEADER_FORMAT) << records.b
+    end
+    module_function :encode
+
+    # Returns the header fields of +blob+ as a Hash with keys :version,
+    # :encoding, :record_size, :time (a Time), and :checksum.  Raises
+    # ArgumentError if +blob+ is not a statusbin blob of a supported version.
+    def decode_header(blob)
+      blob = blob.b
+      if blob.bytesize < HEADER_SIZE || blob[0, 4] != MAGIC
+        raise ArgumentError, 'not a statusbin blob'
+      end
+      _, version, encoding, record_size, nsec, checksum =
+        blob.unpack(HEADER_FORMAT)
+      if version != VERSION
+        raise ArgumentError, "unsupported statusbin version #{version}"
+      end
+      {
+        :version     => version,
+        :encoding    => encoding,
+        :record_size => record_size,
+        :time        => Time.at(nsec / 1_000_000_000, nsec % 1_000_000_000,
+                                :nsec),
+        :checksum    => checksum
+      }
+    end
+    module_function :decode_header
+
+    # Returns the (decompressed) status buffer records of +blob+ as a String.
+    def decode_records(blob)
+      header = decode_header(blob)
+      payload = blob.b[HEADER_SIZE..-1]
+      case header[:encoding]
+      when ENCODING_RAW
+        payload
+      when ENCODING_ZLIB
+        Zlib::Inflate.inflate(payload)
+      else
+        raise ArgumentError,
+          "unsupported statusbin encoding #{header[:encoding]}"
+      end
+    end
+    module_function :decode_records
+
+    # Returns the contents of the status buffer in +blob+ as a Hash, the same
+    # as Status#to_hash would.
+    def decode(blob)
+      size = decode_header(blob)[:record_size]
+      # Split into record size character lines
+      lines = decode_records(blob).scan(/.{#{size}}/m)
+      # Skip END record
+      lines.pop if lines[-1] && lines[-1].start_with?('END ')
+
+      # Parse lines into key and value
+      h = {}
+      lines.each do |l|
+        key, value = l.split('=', 2)
+        value ||= '' # In case no '='
+        key.strip!
+        value.strip!
+        # If value is enclosed in single quotes, remove them and strip spaces
+        value = value[1..-2].strip if /^'.*'$/ =~ value
+        h[key] = value
+      end
+      h
+    end
+    module_function :decode
+
+    # Returns true if +blob+ looks like a statusbin blob.
+    def statusbin?(blob)
+      blob.is_a?(String) && blob.b[0, 4] == MAGIC
+    end
+    module_function :statusbin?
+  end
+end